@@ -0,0 +1,22 @@
+#version 330 core
+
+// input data : block quad, and one instance per falling block
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 2) in vec3 blockInstance;    // x, height when uploaded, kind
+
+uniform mat4 VP;
+uniform float fallDistance;     // fallen since the instances were uploaded
+uniform vec3 palette[3];        // color of each block kind
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Every block falls by the same distance, so its position needs nothing per frame from the CPU
+    vec2 centre = vec2(blockInstance.x, blockInstance.y - fallDistance);
+
+    fragColor = palette[int(blockInstance.z)];
+
+    gl_Position = VP * vec4(vertexPosition.xy + centre, vertexPosition.z, 1);
+}
@@ -0,0 +1,21 @@
+#version 450
+
+// Block.vert for the Vulkan renderer: block quad, and one instance per block in view
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 2) in vec3 blockInstance;    // x, height this frame, kind
+
+layout (set = 0, binding = 0) uniform Frame {
+    mat4 VP;                    // already flipped into Vulkan's clip space
+    vec4 palette[3];            // color of each block kind
+};
+
+// output data : used by fragment shader
+layout (location = 0) out vec3 fragColor;
+
+void main ()
+{
+    // The instances are rewritten every frame, so they have already fallen
+    fragColor = palette[int(blockInstance.z)].rgb;
+
+    gl_Position = VP * vec4(vertexPosition.xy + blockInstance.xy, vertexPosition.z, 1);
+}
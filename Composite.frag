@@ -0,0 +1,15 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 texCoord;
+
+// the offscreen layer being composited
+uniform sampler2D layer;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    color = texture(layer, texCoord).rgb;
+}
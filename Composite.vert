@@ -0,0 +1,13 @@
+#version 330 core
+
+// input data : a quad covering the viewport, already in clip space
+layout (location = 0) in vec3 vertexPosition;
+
+// output data : used by fragment shader
+out vec2 texCoord;
+
+void main ()
+{
+    texCoord = vertexPosition.xy * 0.5 + 0.5;
+    gl_Position = vec4(vertexPosition.xy, 0, 1);
+}
@@ -3,20 +3,23 @@
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
+layout (location = 3) in vec4 objectInstance;   // cos, sin of the rotation, then x, y
 
-uniform mat4 MVP;
+uniform mat4 VP;
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Rotate about the object's origin, then move it into place
+    vec2 p = vec2(objectInstance.x * vertexPosition.x - objectInstance.y * vertexPosition.y,
+                  objectInstance.y * vertexPosition.x + objectInstance.x * vertexPosition.y);
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
     fragColor = vertexColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * position
+    gl_Position = VP * vec4(p + objectInstance.zw, vertexPosition.z, 1);
 }
@@ -2,8 +2,29 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <stdint.h>
 #include <time.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <glad/glad.h>
+#ifdef VULKAN_RENDERER
+#define GLFW_INCLUDE_VULKAN
+#endif
 #include <GLFW/glfw3.h>
 #include <ao/ao.h>
 #include <mpg123.h>
@@ -17,32 +38,187 @@
 
 using namespace std;
 
+/* World units of the simulation. They are floats unless built with
+   -DFIXED_POINT_SIM, which makes them Q16.16 integers so that a run gives
+   bit-identical results whatever the compiler, optimisation flags or CPU.
+   Only the simulation works in Scalar; draw() gets floats from the snapshot. */
+#ifdef FIXED_POINT_SIM
+struct Fixed {
+    int32_t raw;
+
+    Fixed () : raw(0) {}
+    Fixed (int v) : raw(v*65536) {}
+    constexpr Fixed (double v) : raw((int32_t) (v*65536.0 + (v < 0 ? -0.5 : 0.5))) {}
+
+    // Results that do not fit saturate instead of wrapping
+    static Fixed fromRaw (int64_t raw) {
+        Fixed f;
+        f.raw = raw > INT32_MAX ? INT32_MAX : raw < INT32_MIN ? INT32_MIN : (int32_t) raw;
+        return f;
+    }
+
+    Fixed operator- () const { return fromRaw(-(int64_t) raw); }
+    Fixed& operator+= (Fixed other) { *this = fromRaw((int64_t) raw + other.raw); return *this; }
+    Fixed& operator-= (Fixed other) { *this = fromRaw((int64_t) raw - other.raw); return *this; }
+};
+
+inline Fixed operator+ (Fixed a, Fixed b) { return Fixed::fromRaw((int64_t) a.raw + b.raw); }
+inline Fixed operator- (Fixed a, Fixed b) { return Fixed::fromRaw((int64_t) a.raw - b.raw); }
+inline Fixed operator* (Fixed a, Fixed b) { return Fixed::fromRaw(((int64_t) a.raw * b.raw) >> 16); }
+inline Fixed operator/ (Fixed a, Fixed b)
+{
+    if (b.raw == 0)
+        return Fixed::fromRaw(a.raw < 0 ? INT32_MIN : INT32_MAX);
+    return Fixed::fromRaw(((int64_t) a.raw * 65536) / b.raw);
+}
+inline bool operator== (Fixed a, Fixed b) { return a.raw == b.raw; }
+inline bool operator!= (Fixed a, Fixed b) { return a.raw != b.raw; }
+inline bool operator< (Fixed a, Fixed b) { return a.raw < b.raw; }
+inline bool operator> (Fixed a, Fixed b) { return a.raw > b.raw; }
+inline bool operator<= (Fixed a, Fixed b) { return a.raw <= b.raw; }
+inline bool operator>= (Fixed a, Fixed b) { return a.raw >= b.raw; }
+
+inline Fixed fabs (Fixed a) { return a.raw < 0 ? -a : a; }
+
+/* Integer square root, bit by bit */
+inline Fixed sqrt (Fixed a)
+{
+    uint64_t n = a.raw > 0 ? (uint64_t) a.raw << 16 : 0, root = 0;
+    for (uint64_t bit = (uint64_t) 1 << 62; bit; bit >>= 2) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else
+            root >>= 1;
+    }
+    return Fixed::fromRaw(root);
+}
+
+inline float toFloat (Fixed a) { return a.raw / 65536.0f; }
+
+/* Sine and cosine of an angle in degrees, in integers only, since libm's
+   cos() and sin() may differ in the last bit between platforms. The angle is
+   reduced to [0,45] degrees by symmetry and the Taylor series summed in Q2.30. */
+inline void sinCosDegrees (Fixed degrees, Fixed &s, Fixed &c)
+{
+    const int64_t ONE = (int64_t) 1 << 30, QUARTER = 90*65536;
+    const int64_t RADIANS_PER_DEGREE = (int64_t) (M_PI/180*ONE + 0.5);
+    int64_t d = degrees.raw % (4*QUARTER);
+    if (d < 0)
+        d += 4*QUARTER;
+    int quadrant = d / QUARTER;
+    d %= QUARTER;
+    bool swap = d > QUARTER/2;
+    if (swap)
+        d = QUARTER - d;
+
+    int64_t x = d*RADIANS_PER_DEGREE >> 16, x2 = x*x >> 30;
+    int64_t sine = x, cosine = ONE, term = x;
+    for (int n=2; n<=8; n+=2) {
+        term = -(term*x2 >> 30) / (n*(n+1));       // x^(n+1)/(n+1)!
+        sine += term;
+    }
+    term = ONE;
+    for (int n=1; n<=7; n+=2) {
+        term = -(term*x2 >> 30) / (n*(n+1));       // x^(n+1)/(n+1)!
+        cosine += term;
+    }
+    if (swap) {
+        int64_t t = sine;
+        sine = cosine;
+        cosine = t;
+    }
+    Fixed qs = Fixed::fromRaw((sine + (1 << 13)) >> 14), qc = Fixed::fromRaw((cosine + (1 << 13)) >> 14);
+    s = quadrant == 0 ? qs : quadrant == 1 ? qc : quadrant == 2 ? -qs : -qc;
+    c = quadrant == 0 ? qc : quadrant == 1 ? -qs : quadrant == 2 ? -qc : qs;
+}
+
+typedef Fixed Scalar;
+#else
+inline float toFloat (float a) { return a; }
+
+inline void sinCosDegrees (float degrees, float &s, float &c)
+{
+    s = sin(degrees*M_PI/180);
+    c = cos(degrees*M_PI/180);
+}
+
+typedef float Scalar;
+#endif
+
 GLFWwindow* window;
 float SCREEN_ZOOM_STEP = 0.03;
 int score=0,numberOfBlack=0,numberOfMismatch=0;
-float redx=1.5,greenx=-1.5,turret_angle=1,turrety=0;
+Scalar redx=1.5,greenx=-1.5,turrety=0;
+Scalar prev_redx=1.5,prev_greenx=-1.5;  // basket positions at the last simulation tick
 float screen_left,screen_right,screen_top,screen_bottom;
-float camera_rotation_angle = 90,laser_x,laser_y;
-float turret_rectangle_rotation = 0,rectangle_rotation=0,laser_rotation;
-float screen_x=0,screen_y=0,blockSpeed=0.010,zoom=1.0,CURSOR_X=0,CURSOR_Y=0;
+float camera_rotation_angle = 90;
+Scalar laser_x,laser_y;
+float rectangle_rotation=0;
+Scalar turret_dx=1,turret_dy=0,laser_dx=1,laser_dy=0;  // unit directions the turret points and the laser flies in
+Scalar blockSpeed=0.010;
+float screen_x=0,screen_y=0,zoom=1.0,CURSOR_X=0,CURSOR_Y=0;
 //int draw_flag = 0, number_of_blocks = 0, i;
-vector <float> block_x;
-vector <float> block_y;
+/* Blocks in spawn order, see the Simulation section for how they fall */
+vector <Scalar> block_x;
+vector <Scalar> block_base_y;
 vector <int> block_color;
+vector <long> block_serial;
+long block_generation = 0;      // bumped whenever a block is added or removed
+Scalar fall_distance = 0;
 bool redbucket_clicked = false, greenbucket_clicked = false, turret_clicked = false;
-float mirror_y=0.2;
 int laserFlag=0;
+bool fire_requested = false;    // set by input callbacks, fired on the next simulation tick
+bool save_requested = false, restore_requested = false;    // F5 and F9, handled between ticks
+/* Owns its GL objects, so it must be destroyed while the context is current.
+   A renderer that does not draw with GL gets one with no GL objects. */
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLuint ColorBuffer;   // 0 when every vertex has Color
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    GLfloat Color[3];
+    const GLfloat *Vertices;  // what VertexBuffer was made from, for the software rasterizer; NULL if rewritten per draw
+
+    VAO () : VertexArrayID(0), VertexBuffer(0), ColorBuffer(0), Vertices(NULL) {}
+    ~VAO () {
+        if (!VertexArrayID)
+            return;
+        glDeleteBuffers(1, &VertexBuffer);
+        if (ColorBuffer)
+            glDeleteBuffers(1, &ColorBuffer);
+        glDeleteVertexArrays(1, &VertexArrayID);
+    }
+
+private:
+    VAO (const VAO&);
+    VAO& operator= (const VAO&);
 };
 typedef struct VAO VAO;
 
+struct WorldSnapshot;
+
+/* A backend turns a world snapshot into a frame in the window. All of them
+   take the scene from the render queue and renderLoop keeps the pacing, so
+   a new backend only fills in RENDERERS. Every entry runs on the render
+   thread, with the GL context current for those that have one. */
+struct Renderer {
+    const char *name;
+    int gl_major, gl_minor;     // the oldest GL context it can present with, 0.0 for a window without GL
+    bool gl_draws;              // draws with GL: meshes get VAOs and frames get fences
+    void (*start) ();
+    void (*stop) ();
+    void (*begin) (long frame);                             // wait until this frame's resources are free
+    void (*frame) (const WorldSnapshot &world, long frame); // build and submit it
+    void (*present) (long frame);
+};
+
+const Renderer *renderer;       // picked by --renderer in main
+string renderer_device;         // what it draws on, for --bench-frames; set when it starts
+
 struct GLMatrices {
     glm::mat4 projection;
     glm::mat4 model;
@@ -52,109 +228,687 @@ struct GLMatrices {
 
 GLuint programID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* Linked program binaries are cached in SHADER_CACHE_DIR, one file per
+   (shader sources, driver) pair, so a warm start skips compilation. */
+#define SHADER_CACHE_DIR ".shadercache"
+#define SHADER_CACHE_MAGIC 0x48534242   // "BBSH"
 
-    // Create the shaders
-    GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-    GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+struct ShaderCacheHeader {
+    uint32_t magic;
+    uint32_t binary_format;
+    uint64_t key;
+    uint32_t binary_length;
+};
 
-    // Read the Vertex Shader code from the file
-    std::string VertexShaderCode;
-    std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-    if(VertexShaderStream.is_open())
-    {
-        std::string Line = "";
-        while(getline(VertexShaderStream, Line))
-            VertexShaderCode += "\n" + Line;
-        VertexShaderStream.close();
+/* 64-bit FNV-1a, chained through seed */
+uint64_t hashBytes (const void *data, size_t length, uint64_t seed=14695981039346656037ULL)
+{
+    const unsigned char *bytes = (const unsigned char*) data;
+    for (size_t i=0; i<length; i++)
+        seed = (seed ^ bytes[i]) * 1099511628211ULL;
+    return seed;
+}
+
+string readShaderSource (const char *path)
+{
+    ifstream stream(path, ios::in | ios::binary);
+    if (!stream.is_open()) {
+        fprintf(stderr, "Cannot open shader %s\n", path);
+        return string();
     }
+    ostringstream source;
+    source << stream.rdbuf();
+    return source.str();
+}
+
+bool programBinarySupported ()
+{
+    if (!GLAD_GL_VERSION_4_1 && !GLAD_GL_ARB_get_program_binary)
+        return false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
 
-    // Read the Fragment Shader code from the file
-    std::string FragmentShaderCode;
-    std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-    if(FragmentShaderStream.is_open()){
-        std::string Line = "";
-        while(getline(FragmentShaderStream, Line))
-            FragmentShaderCode += "\n" + Line;
-        FragmentShaderStream.close();
+/* Compile one shader stage, printing the info log only when it fails */
+GLuint compileShader (GLenum type, const string &source, const char *path)
+{
+    GLuint ShaderID = glCreateShader(type);
+    char const * SourcePointer = source.c_str();
+    glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+    glCompileShader(ShaderID);
+
+    GLint Result = GL_FALSE;
+    glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+    if (Result != GL_TRUE) {
+        int InfoLogLength = 0;
+        glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+        std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+        glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+        fprintf(stderr, "Compiling shader %s failed:\n%s\n", path, &ShaderErrorMessage[0]);
     }
+    return ShaderID;
+}
 
+bool programLinked (GLuint ProgramID)
+{
     GLint Result = GL_FALSE;
-    int InfoLogLength;
-
-    // Compile Vertex Shader
-    printf("Compiling shader : %s\n", vertex_file_path);
-    char const * VertexSourcePointer = VertexShaderCode.c_str();
-    glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-    glCompileShader(VertexShaderID);
-
-    // Check Vertex Shader
-    glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-    // Compile Fragment Shader
-    printf("Compiling shader : %s\n", fragment_file_path);
-    char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-    glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-    glCompileShader(FragmentShaderID);
-
-    // Check Fragment Shader
-    glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-    fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+    return Result == GL_TRUE;
+}
+
+GLuint loadCachedProgram (const string &cache_path, uint64_t key)
+{
+    ifstream cache(cache_path.c_str(), ios::in | ios::binary | ios::ate);
+    streamoff file_size = cache.tellg();
+    cache.seekg(0);
+    ShaderCacheHeader header;
+    if (!cache.read((char*) &header, sizeof(header)) || header.magic != SHADER_CACHE_MAGIC || header.key != key)
+        return 0;
+    // The binary is the rest of the file; any other length is a truncated or corrupt entry
+    if (header.binary_length == 0 || header.binary_length != file_size - (streamoff) sizeof(header))
+        return 0;
+    std::vector<char> binary(header.binary_length);
+    if (!cache.read(&binary[0], binary.size()))
+        return 0;
+
+    GLuint ProgramID = glCreateProgram();
+    glProgramBinary(ProgramID, header.binary_format, &binary[0], binary.size());
+    if (!programLinked(ProgramID)) {
+        // Driver update or corrupt file, rebuild from source
+        glDeleteProgram(ProgramID);
+        return 0;
+    }
+    return ProgramID;
+}
+
+void storeCachedProgram (const string &cache_path, uint64_t key, GLuint ProgramID)
+{
+    GLint length = 0;
+    glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(ProgramID, length, NULL, &format, &binary[0]);
+
+    ShaderCacheHeader header = { SHADER_CACHE_MAGIC, format, key, (uint32_t) length };
+    mkdir(SHADER_CACHE_DIR, 0755);
+    string temp_path = cache_path + ".tmp";
+    ofstream cache(temp_path.c_str(), ios::out | ios::binary | ios::trunc);
+    cache.write((const char*) &header, sizeof(header));
+    cache.write(&binary[0], binary.size());
+    cache.close();
+    if (cache)
+        rename(temp_path.c_str(), cache_path.c_str());
+}
+
+/* Load a shader program, from the binary cache when the sources and driver are unchanged.
+   Returns 0 if the program does not link */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+
+    // Read the shader code from the files
+    std::string VertexShaderCode = readShaderSource(vertex_file_path);
+    std::string FragmentShaderCode = readShaderSource(fragment_file_path);
+
+    bool use_cache = programBinarySupported();
+    uint64_t key = 0;
+    string cache_path;
+    if (use_cache) {
+        key = hashBytes(VertexShaderCode.data(), VertexShaderCode.size());
+        key = hashBytes(FragmentShaderCode.data(), FragmentShaderCode.size(), key);
+        const GLenum driver_strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        for (int i=0; i<3; i++) {
+            const char *driver = (const char*) glGetString(driver_strings[i]);
+            key = hashBytes(driver, strlen(driver), key);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) key);
+        cache_path = string(SHADER_CACHE_DIR) + name;
+
+        GLuint ProgramID = loadCachedProgram(cache_path, key);
+        if (ProgramID)
+            return ProgramID;
+    }
+
+    GLuint VertexShaderID = compileShader(GL_VERTEX_SHADER, VertexShaderCode, vertex_file_path);
+    GLuint FragmentShaderID = compileShader(GL_FRAGMENT_SHADER, FragmentShaderCode, fragment_file_path);
 
     // Link the program
-    fprintf(stdout, "Linking program\n");
     GLuint ProgramID = glCreateProgram();
     glAttachShader(ProgramID, VertexShaderID);
     glAttachShader(ProgramID, FragmentShaderID);
+    if (use_cache)
+        glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(ProgramID);
 
-    // Check the program
-    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-    glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-    glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-    fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
     glDeleteShader(VertexShaderID);
     glDeleteShader(FragmentShaderID);
 
+    // Check the program
+    if (!programLinked(ProgramID)) {
+        int InfoLogLength = 0;
+        glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+        std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+        glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        fprintf(stderr, "Linking %s + %s failed:\n%s\n", vertex_file_path, fragment_file_path, &ProgramErrorMessage[0]);
+        glDeleteProgram(ProgramID);
+        return 0;
+    }
+
+    if (use_cache)
+        storeCachedProgram(cache_path, key, ProgramID);
     return ProgramID;
 }
 
+#ifdef DEV_BUILD
+/* Dev builds relink programs whose shader files change on disk */
+struct WatchedProgram {
+    GLuint *program;
+    const char *vertex_file_path, *fragment_file_path;
+    time_t vertex_mtime, fragment_mtime;
+    void (*on_reload) ();            // refresh uniform locations
+};
+vector <WatchedProgram> watched_programs;
+double last_shader_check = 0;
+
+time_t fileMtime (const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
+void watchShaders (GLuint *program, const char *vertex_file_path, const char *fragment_file_path, void (*on_reload) ())
+{
+    WatchedProgram watched = { program, vertex_file_path, fragment_file_path,
+                               fileMtime(vertex_file_path), fileMtime(fragment_file_path), on_reload };
+    watched_programs.push_back(watched);
+}
+
+/* Called every frame, looks at the files twice a second */
+void reloadChangedShaders (double now)
+{
+    if (now - last_shader_check < 0.5)
+        return;
+    last_shader_check = now;
+    for (int i=0; i<watched_programs.size(); i++) {
+        WatchedProgram &watched = watched_programs[i];
+        time_t vertex_mtime = fileMtime(watched.vertex_file_path);
+        time_t fragment_mtime = fileMtime(watched.fragment_file_path);
+        if (vertex_mtime == watched.vertex_mtime && fragment_mtime == watched.fragment_mtime)
+            continue;
+        watched.vertex_mtime = vertex_mtime;
+        watched.fragment_mtime = fragment_mtime;
+
+        GLuint program = LoadShaders(watched.vertex_file_path, watched.fragment_file_path);
+        if (!program)
+            continue;   // keep the old program until the sources are fixed
+        printf("Reloaded %s + %s\n", watched.vertex_file_path, watched.fragment_file_path);
+        glDeleteProgram(*watched.program);
+        *watched.program = program;
+        watched.on_reload();
+    }
+}
+#endif
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Ends the game loop, main() tears down GL and the window afterwards */
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    //    exit(EXIT_SUCCESS);
+    glfwSetWindowShouldClose(window, GL_TRUE);
 }
 
+/**************************
+ * Command line options   *
+ **************************/
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+#define MAX_FRAMES_IN_FLIGHT 3
+
+struct Options {
+    const char *level_path;
+    int frames_in_flight;       // frames the GPU may queue before draw() waits, 1..MAX_FRAMES_IN_FLIGHT
+    bool profile;               // print frame timings every few seconds
+    int target_fps;             // frame rate cap, 0 to leave pacing to vsync
+    bool vsync;
+    bool hitscan;               // the laser hits instantly along its traced path
+    bool aim_preview;           // draw the path the laser would take
+    long sim_check_ticks;       // run headless for this many ticks and print a hash of the world
+    const char *record_path;    // write a replay of this game
+    bool record_hashes;         // with a world hash every tick
+    const char *play_path;      // play a replay instead of taking input
+    bool verify_replay;         // play it headless and report divergence
+    long seek_tick;             // start playback at this tick
+    const char *save_path;      // autosave here and resume from it
+    bool dynamic_resolution;    // draw the playfield smaller when the GPU falls behind
+    const char *renderer;       // name of the backend that draws the frames, see RENDERERS
+    long bench_frames;          // draw this many frames unpaced, print the frame time and quit
+    long transform_bench;       // time transforming this many objects each way and quit
+} options = { "levels/default.lvl", 2, false, 0, true, false, true, 0, NULL, false, NULL, false, 0, NULL, true, "gl", 0, 0 };
+
+void usage (const char *program)
+{
+    fprintf(stderr, "usage: %s [options] [level.lvl|level.bin]\n"
+                    "       %s --compile-level level.lvl level.bin\n"
+                    "       %s --self-test\n"
+                    "options:\n"
+                    "  --frames-in-flight N   frames queued on the GPU, 1 (lowest aim latency) to %d\n"
+                    "  --profile              print frame timings\n"
+                    "  --fps N                cap the frame rate at N\n"
+                    "  --no-vsync             do not wait for vertical blank, implies --fps 60 unless given\n"
+                    "  --hitscan              the laser hits instantly instead of travelling\n"
+                    "  --no-aim-preview       do not draw the laser's path\n"
+                    "  --no-dynamic-resolution\n"
+                    "                         always draw at the window's full resolution\n"
+                    "  --renderer NAME        draw with gl (the default), software, the CPU rasterizer,\n"
+                    "                         or vulkan in a build made with \"make vulkan\"\n"
+                    "  --software             same as --renderer software\n"
+                    "  --bench-frames N       draw N frames as fast as possible, print the time per frame and quit\n"
+                    "  --transform-bench N    time placing N objects with glm::mat4 and with 2x3 transforms\n"
+                    "  --sim-check TICKS      simulate headless with scripted input and print a hash of the result\n"
+                    "  --record FILE          record a replay\n"
+                    "  --record-hashes        store a world hash for every tick in the replay\n"
+                    "  --play FILE            play a replay back\n"
+                    "  --verify-replay FILE   play a replay headless and report the first tick that differs\n"
+                    "  --seek TICK            start playing the replay at TICK\n"
+                    "  --save FILE            save the game to FILE every few seconds and resume from it,\n"
+                    "                         F5 saves now and F9 goes back to the last save\n",
+            program, program, program, MAX_FRAMES_IN_FLIGHT);
+}
+
+bool parseOptions (int argc, char **argv)
+{
+    bool have_level = false;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--frames-in-flight") == 0 && i+1 < argc) {
+            options.frames_in_flight = atoi(argv[++i]);
+            if (options.frames_in_flight < 1 || options.frames_in_flight > MAX_FRAMES_IN_FLIGHT)
+                return false;
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+            options.profile = true;
+        else if (strcmp(argv[i], "--fps") == 0 && i+1 < argc) {
+            options.target_fps = atoi(argv[++i]);
+            if (options.target_fps <= 0)
+                return false;
+        }
+        else if (strcmp(argv[i], "--no-vsync") == 0)
+            options.vsync = false;
+        else if (strcmp(argv[i], "--hitscan") == 0)
+            options.hitscan = true;
+        else if (strcmp(argv[i], "--no-aim-preview") == 0)
+            options.aim_preview = false;
+        else if (strcmp(argv[i], "--no-dynamic-resolution") == 0)
+            options.dynamic_resolution = false;
+        else if (strcmp(argv[i], "--renderer") == 0 && i+1 < argc)
+            options.renderer = argv[++i];
+        else if (strcmp(argv[i], "--software") == 0)
+            options.renderer = "software";
+        else if (strcmp(argv[i], "--bench-frames") == 0 && i+1 < argc) {
+            options.bench_frames = atol(argv[++i]);
+            if (options.bench_frames <= 0)
+                return false;
+            options.vsync = false;
+            options.target_fps = 0;
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i+1 < argc)
+            options.record_path = argv[++i];
+        else if (strcmp(argv[i], "--record-hashes") == 0)
+            options.record_hashes = true;
+        else if (strcmp(argv[i], "--play") == 0 && i+1 < argc)
+            options.play_path = argv[++i];
+        else if (strcmp(argv[i], "--verify-replay") == 0 && i+1 < argc) {
+            options.play_path = argv[++i];
+            options.verify_replay = true;
+        }
+        else if (strcmp(argv[i], "--seek") == 0 && i+1 < argc) {
+            options.seek_tick = atol(argv[++i]);
+            if (options.seek_tick < 0)
+                return false;
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i+1 < argc)
+            options.save_path = argv[++i];
+        else if (strcmp(argv[i], "--transform-bench") == 0 && i+1 < argc) {
+            options.transform_bench = atol(argv[++i]);
+            if (options.transform_bench <= 0)
+                return false;
+        }
+        else if (strcmp(argv[i], "--sim-check") == 0 && i+1 < argc) {
+            options.sim_check_ticks = atol(argv[++i]);
+            if (options.sim_check_ticks <= 0)
+                return false;
+        }
+        else if (argv[i][0] != '-' && !have_level) {
+            options.level_path = argv[i];
+            have_level = true;
+        }
+        else
+            return false;
+    }
+    if (!options.vsync && !options.target_fps && !options.bench_frames)
+        options.target_fps = 60;
+    // A replay starts from a fresh level, so it cannot be mixed with save states
+    return !(options.record_path && options.play_path) && !(options.save_path && (options.record_path || options.play_path));
+}
+
+/**************************
+ * Startup tracing        *
+ **************************/
+
+/* Each startup phase is recorded with the thread it ran on and printed
+   once the first frame is on screen */
+struct StartupPhase {
+    const char *name;
+    const char *thread;
+    double start_ms, end_ms;
+};
+
+chrono::steady_clock::time_point startup_begin = chrono::steady_clock::now();
+vector <StartupPhase> startup_phases;
+mutex startup_mutex;
+
+double startupMs ()
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - startup_begin).count();
+}
+
+/* Times the enclosing scope as one startup phase */
+struct StartupTimer {
+    const char *name, *thread;
+    double start_ms;
+    StartupTimer (const char *name, const char *thread="main") : name(name), thread(thread), start_ms(startupMs()) {}
+    ~StartupTimer () {
+        StartupPhase phase = { name, thread, start_ms, startupMs() };
+        lock_guard<mutex> lock(startup_mutex);
+        startup_phases.push_back(phase);
+    }
+};
+
+void reportStartup ()
+{
+    lock_guard<mutex> lock(startup_mutex);
+    printf("Startup (ms):\n");
+    for (int i=0; i<startup_phases.size(); i++) {
+        const StartupPhase &phase = startup_phases[i];
+        printf("  %-6s %8.2f %8.2f  %7.2f  %s\n", phase.thread, phase.start_ms, phase.end_ms,
+               phase.end_ms - phase.start_ms, phase.name);
+    }
+    printf("  first frame at %.2f\n", startupMs());
+}
+
+/**************************
+ * Level files            *
+ **************************/
+
+/* Levels are authored as text (see levels/default.lvl) and compiled to a flat
+   binary (.bin next to the .lvl) that is mmap'ed at load and read in place.
+   The binary is a LevelHeader followed by the mirrors and then the spawns. */
+
+#define LEVEL_MAGIC 0x564c4242   // "BBLV"
+#define LEVEL_VERSION 1
+
+struct LevelMirror {
+    float x, y, angle;               // start position and rotation in degrees
+    float path_ax, path_ay;          // moving mirrors travel from a to b and
+    float path_bx, path_by;          // jump back to a, path_speed units per tick
+    float path_speed;                // 0 for a fixed mirror
+};
+
+struct LevelSpawn {
+    float time;                      // seconds since the round started
+    float x;
+    int color;                       // same as block_color
+};
+
+struct LevelHeader {
+    uint32_t magic, version;
+    uint32_t num_mirrors, num_spawns;
+    float spawn_interval;            // random spawns, 0 to only use the schedule
+    float spawn_y, spawn_min_x, spawn_max_x;
+    float block_speed, min_block_speed, max_block_speed;
+    float red_x, green_x;
+    int lose_below;
+};
+
+struct Level {
+    const LevelHeader *header;
+    const LevelMirror *mirrors;
+    const LevelSpawn *spawns;
+    void *map;
+    size_t map_size;
+} level;
+
+/* Runtime state of the level's mirrors */
+vector <Scalar> mirror_x, mirror_y, mirror_phase, mirror_cos, mirror_sin;
+
+int blockColorFromName (const string &name)
+{
+    if (name == "red") return 0;
+    if (name == "green") return 1;
+    if (name == "black") return 2;
+    return -1;
+}
+
+/* Parse a text level and write it out in the binary format */
+bool compileLevel (const char *text_path, const char *binary_path)
+{
+    ifstream in(text_path);
+    if (!in.is_open()) {
+        fprintf(stderr, "Cannot open level %s\n", text_path);
+        return false;
+    }
+
+    LevelHeader header = {};
+    header.magic = LEVEL_MAGIC;
+    header.version = LEVEL_VERSION;
+    header.spawn_interval = 3.0;
+    header.spawn_y = 4.5;
+    header.spawn_min_x = -3.5;
+    header.spawn_max_x = 2.0;
+    header.block_speed = 0.010;
+    header.min_block_speed = 0.005;
+    header.max_block_speed = 0.020;
+    header.red_x = 1.5;
+    header.green_x = -1.5;
+    header.lose_below = -20;
+    vector <LevelMirror> mirrors;
+    vector <LevelSpawn> spawns;
+
+    string line;
+    int line_number = 0;
+    while (getline(in, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        string key;
+        if (!(words >> key))
+            continue;
+
+        bool ok = true;
+        if (key == "spawn_interval")
+            ok = (bool)(words >> header.spawn_interval);
+        else if (key == "spawn_y")
+            ok = (bool)(words >> header.spawn_y);
+        else if (key == "spawn_x")
+            ok = (bool)(words >> header.spawn_min_x >> header.spawn_max_x);
+        else if (key == "block_speed")
+            ok = (bool)(words >> header.block_speed >> header.min_block_speed >> header.max_block_speed) &&
+                 0 < header.min_block_speed && header.min_block_speed <= header.block_speed &&
+                 header.block_speed <= header.max_block_speed;  // blocks always fall, see maxLiveBlocks
+        else if (key == "lose_below")
+            ok = (bool)(words >> header.lose_below);
+        else if (key == "basket") {
+            string color;
+            float x;
+            ok = (bool)(words >> color >> x);
+            if (color == "red") header.red_x = x;
+            else if (color == "green") header.green_x = x;
+            else ok = false;
+        }
+        else if (key == "mirror") {
+            LevelMirror m = {};
+            ok = (bool)(words >> m.x >> m.y >> m.angle);
+            string path;
+            if (ok && words >> path)
+                ok = path == "path" && (words >> m.path_ax >> m.path_ay >> m.path_bx >> m.path_by >> m.path_speed) &&
+                     (m.path_speed <= 0 || m.path_ax != m.path_bx || m.path_ay != m.path_by);  // moving needs a path with a length
+            mirrors.push_back(m);
+        }
+        else if (key == "spawn") {
+            LevelSpawn s = {};
+            string color;
+            ok = (bool)(words >> s.time >> s.x >> color);
+            s.color = blockColorFromName(color);
+            ok = ok && s.color >= 0;
+            spawns.push_back(s);
+        }
+        else
+            ok = false;
+
+        if (!ok) {
+            fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", text_path, line_number, line.c_str());
+            return false;
+        }
+    }
+    header.num_mirrors = mirrors.size();
+    header.num_spawns = spawns.size();
+
+    FILE *out = fopen(binary_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot write level %s\n", binary_path);
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(mirrors.data(), sizeof(LevelMirror), mirrors.size(), out);
+    fwrite(spawns.data(), sizeof(LevelSpawn), spawns.size(), out);
+    return fclose(out) == 0;
+}
+
+/* A block falls at least min_block_speed a tick from spawn_y until it leaves
+   below -4.5, and at most one random block spawns a tick, so no more blocks
+   than this are ever in play at once */
+size_t maxLiveBlocks (const LevelHeader &header)
+{
+    size_t falling_ticks = (size_t) (max(0.0f, header.spawn_y + 4.5f)/header.min_block_speed) + 1;
+    return header.num_spawns + (header.spawn_interval > 0 ? falling_ticks : 0);
+}
+
+/* Map a binary level, compiling it first when given a text level that is newer than its binary */
+bool loadLevel (const char *path)
+{
+    string binary_path = path;
+    size_t dot = binary_path.rfind(".lvl");
+    if (dot != string::npos && dot == binary_path.size() - 4) {
+        binary_path.replace(dot, 4, ".bin");
+        struct stat text_stat, binary_stat;
+        if (stat(path, &text_stat) != 0) {
+            fprintf(stderr, "Cannot open level %s\n", path);
+            return false;
+        }
+        if (stat(binary_path.c_str(), &binary_stat) != 0 || binary_stat.st_mtime < text_stat.st_mtime)
+            if (!compileLevel(path, binary_path.c_str()))
+                return false;
+    }
+
+    int fd = open(binary_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open level %s\n", binary_path.c_str());
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map level %s\n", binary_path.c_str());
+        return false;
+    }
+
+    const LevelHeader *header = (const LevelHeader*) map;
+    if ((size_t) st.st_size < sizeof(LevelHeader) || header->magic != LEVEL_MAGIC || header->version != LEVEL_VERSION ||
+        (size_t) st.st_size != sizeof(LevelHeader) + header->num_mirrors*sizeof(LevelMirror) + header->num_spawns*sizeof(LevelSpawn) ||
+        !(header->min_block_speed > 0)) {
+        fprintf(stderr, "%s is not a level file, rebuild it from its .lvl\n", binary_path.c_str());
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    level.header = header;
+    level.mirrors = (const LevelMirror*) (header + 1);
+    level.spawns = (const LevelSpawn*) (level.mirrors + header->num_mirrors);
+    level.map = map;
+    level.map_size = st.st_size;
+
+    redx = prev_redx = header->red_x;
+    greenx = prev_greenx = header->green_x;
+    blockSpeed = header->block_speed;
+
+    int n = header->num_mirrors;
+    mirror_x.resize(n);
+    mirror_y.resize(n);
+    mirror_phase.assign(n, 0);
+    mirror_cos.resize(n);
+    mirror_sin.resize(n);
+    for (int i=0; i<n; i++) {
+        const LevelMirror &m = level.mirrors[i];
+        mirror_x[i] = m.x;
+        mirror_y[i] = m.y;
+        sinCosDegrees(m.angle, mirror_sin[i], mirror_cos[i]);
+        if (m.path_speed > 0) {
+            // Start the mirror where the level places it along its path
+            Scalar dx = (Scalar) m.path_bx - m.path_ax, dy = (Scalar) m.path_by - m.path_ay;
+            Scalar length = sqrt(dx*dx + dy*dy);
+            mirror_phase[i] = (((Scalar) m.x - m.path_ax)*dx + ((Scalar) m.y - m.path_ay)*dy) / length;
+        }
+    }
+    return true;
+}
+
+void unloadLevel ()
+{
+    if (level.map)
+        munmap(level.map, level.map_size);
+    level = Level();
+}
+
+/* Move the mirrors that follow a path by one tick */
+void moveMirrors ()
+{
+    for (int i=0; i<mirror_x.size(); i++) {
+        const LevelMirror &m = level.mirrors[i];
+        if (m.path_speed <= 0)
+            continue;
+        Scalar dx = (Scalar) m.path_bx - m.path_ax, dy = (Scalar) m.path_by - m.path_ay;
+        Scalar length = sqrt(dx*dx + dy*dy);
+        mirror_phase[i] += m.path_speed;
+        if (mirror_phase[i] > length)
+            mirror_phase[i] = 0;
+        mirror_x[i] = (Scalar) m.path_ax + dx*mirror_phase[i]/length;
+        mirror_y[i] = (Scalar) m.path_ay + dy*mirror_phase[i]/length;
+    }
+}
+
+
+/* Generate the VAO and vertex VBO shared by both create3DObject overloads.
+   Attribute 1 starts disabled in the new VAO. A renderer that does not draw
+   with GL only reads Vertices, so it gets no GL objects at all. */
+unique_ptr<VAO> createVertexArray (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, GLenum fill_mode)
 {
-    struct VAO* vao = new struct VAO;
+    unique_ptr<VAO> vao(new VAO);
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->Vertices = vertex_buffer_data;
+    if (!renderer->gl_draws)
+        return vao;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
     glBindVertexArray (vao->VertexArrayID); // Bind the VAO
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
@@ -167,7 +921,19 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                 0,                  // stride
                 (void*)0            // array buffer offset
                 );
+    glEnableVertexAttribArray(0);
+
+    return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+unique_ptr<VAO> create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    unique_ptr<VAO> vao = createVertexArray(primitive_mode, numVertices, vertex_buffer_data, fill_mode);
+    if (!renderer->gl_draws)
+        return vao;
 
+    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
     glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
@@ -178,46 +944,71 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                 0,                  // stride
                 (void*)0            // array buffer offset
                 );
+    glEnableVertexAttribArray(1);
 
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices.
+   No color VBO is made: attribute 1 is left disabled and draw3DObject feeds
+   the color in as a constant vertex attribute */
+unique_ptr<VAO> create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
-    }
+    unique_ptr<VAO> vao = createVertexArray(primitive_mode, numVertices, vertex_buffer_data, fill_mode);
+    vao->Color[0] = red;
+    vao->Color[1] = green;
+    vao->Color[2] = blue;
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+void draw3DObject (const VAO* vao)
 {
     // Change the Fill Mode for this object
     glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
 
-    // Bind the VAO to use
+    // Bind the VAO to use, it remembers which attributes are enabled
     glBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
-
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    // Constant color when there is no color VBO
+    if (!vao->ColorBuffer)
+        glVertexAttrib3f(1, vao->Color[0], vao->Color[1], vao->Color[2]);
 
     // Draw the geometry !
     glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
 }
 
+#ifdef COUNT_ALLOCATIONS
+/* Allocation checking build: count operator new calls per thread so the
+   game loop can verify it runs without touching the heap */
+thread_local long allocation_count = 0;
+
+void* operator new (size_t size)
+{
+    allocation_count++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete (void *p) noexcept
+{
+    free(p);
+}
+
+/* Past the first few iterations everything a loop needs is already allocated */
+void checkAllocations (const char *loop, long iteration)
+{
+    if (iteration > 2 && allocation_count > 0) {
+        fprintf(stderr, "%s %ld made %ld heap allocations\n", loop, iteration, allocation_count);
+        abort();
+    }
+    allocation_count = 0;
+}
+#endif
+
 /**************************
  * Customizable functions *
  **************************/
@@ -239,6 +1030,73 @@ bool rectangle_rot_status = true;
     Matrices.projection = glm::ortho(left, right, bottom, top, 0.1f, 500.0f);
 }*/
 
+/* While paused or unfocused the simulation stops and both threads only
+   wake up for input, so an idle kiosk draws next to no power */
+atomic<bool> paused(false), window_focused(true);
+
+bool gameIdle ()
+{
+    return paused || !window_focused;
+}
+
+void windowFocus (GLFWwindow* window, int focused)
+{
+    window_focused = focused != 0;
+}
+
+void togglePause (GLFWwindow* window)
+{
+    paused = !paused;
+    glfwSetWindowTitle(window, paused ? "Brick Breaker (paused)" : "Brick Breaker");
+}
+
+/* The turret and laser carry unit direction vectors rather than angles, so
+   moving, reflecting and drawing them needs no trig. Turning the turret
+   applies one of these rotations, worked out once at startup. */
+struct Rotation {
+    Scalar c, s;
+};
+
+Rotation rotationDegrees (float degrees)
+{
+    Rotation r;
+    sinCosDegrees(degrees, r.s, r.c);
+    return r;
+}
+
+const Rotation TURRET_STEP = rotationDegrees(3), TURRET_FAST_STEP = rotationDegrees(5);
+
+/* Turn the turret by step, anticlockwise if direction is 1 and clockwise if -1,
+   keeping it between straight down and straight up */
+void rotateTurret (const Rotation &step, int direction)
+{
+    Scalar s = direction*step.s;
+    Scalar dx = step.c*turret_dx - s*turret_dy;
+    Scalar dy = s*turret_dx + step.c*turret_dy;
+    if (dx < 0) {
+        dx = 0;
+        dy = dy < 0 ? -1 : 1;
+    }
+    Scalar length = sqrt(dx*dx + dy*dy);   // keeps rounding from building up
+    turret_dx = dx/length;
+    turret_dy = dy/length;
+}
+
+/* Unit direction from the turret to (x,y), folded into the right half like atan() did */
+void aimAt (float x, float y, Scalar &dx, Scalar &dy)
+{
+    Scalar ax = x + 4, ay = y - turrety;
+    if (ax < 0) {
+        ax = -ax;
+        ay = -ay;
+    }
+    Scalar length = sqrt(ax*ax + ay*ay);
+    if (length == 0)
+        return;
+    dx = ax/length;
+    dy = ay/length;
+}
+
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     // Function is called first on GLFW_PRESS.
@@ -259,30 +1117,30 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
     }
     if (action == GLFW_PRESS) {
         switch (key) {
+        case GLFW_KEY_P:
+            togglePause(window);
+            break;
+        case GLFW_KEY_F5:
+            save_requested = true;
+            break;
+        case GLFW_KEY_F9:
+            restore_requested = true;
+            break;
         case GLFW_KEY_SPACE:
-            laserFlag=1;
-            laser_x=-4;
-            laser_y=turrety;
-            laser_rotation=turret_rectangle_rotation;
+            fire_requested = true;
             break;
         case GLFW_KEY_ESCAPE:
-            if(score > 100)
-                cout << "YOU WON" << endl;
-            if(score < 100)
-                cout << "YOU LOST" << endl;
-            cout << score << endl;
-
             quit(window);
             break;
         case GLFW_KEY_M:
             blockSpeed+=0.001;
-            if(blockSpeed>=0.020)
-                blockSpeed=0.020;
+            if(blockSpeed>=level.header->max_block_speed)
+                blockSpeed=level.header->max_block_speed;
             break;
         case GLFW_KEY_N:
             blockSpeed-=0.001;
-            if(blockSpeed<=0.005)
-                blockSpeed=0.005;
+            if(blockSpeed<=level.header->min_block_speed)
+                blockSpeed=level.header->min_block_speed;
             break;
         case GLFW_KEY_LEFT:
             if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL))
@@ -367,14 +1225,10 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 turrety=-3.5;
             break;
         case GLFW_KEY_A:
-            turret_rectangle_rotation+=3;
-            if(turret_rectangle_rotation>=90)
-                turret_rectangle_rotation=90;
+            rotateTurret(TURRET_STEP, 1);
             break;
         case GLFW_KEY_D:
-            turret_rectangle_rotation-=3;
-            if(turret_rectangle_rotation<=-90)
-                turret_rectangle_rotation=-90;
+            rotateTurret(TURRET_STEP, -1);
             break;
         case GLFW_KEY_UP:
            zoom+=0.1;
@@ -393,28 +1247,20 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
     if (action== GLFW_REPEAT) {
         switch (key) {
         case GLFW_KEY_SPACE:
-            laserFlag=1;
-            laser_x=-4;
-            laser_y=turrety;
-            laser_rotation=turret_rectangle_rotation;
+            fire_requested = true;
             break;
         case GLFW_KEY_ESCAPE:
-            if(score > 100)
-                cout << "YOU WON" << endl;
-            if(score < 100)
-                cout << "YOU LOST" << endl;
-            cout << score << endl;
             quit(window);
             break;
         case GLFW_KEY_M:
             blockSpeed+=0.001;
-            if(blockSpeed>=0.020)
-                blockSpeed=0.020;
+            if(blockSpeed>=level.header->max_block_speed)
+                blockSpeed=level.header->max_block_speed;
             break;
         case GLFW_KEY_N:
             blockSpeed-=0.001;
-            if(blockSpeed<=0.005)
-                blockSpeed=0.005;
+            if(blockSpeed<=level.header->min_block_speed)
+                blockSpeed=level.header->min_block_speed;
             break;
         case GLFW_KEY_LEFT:
             if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL))
@@ -499,14 +1345,10 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
                 turrety=-3.5;
             break;
         case GLFW_KEY_A:
-            turret_rectangle_rotation+=5;
-            if(turret_rectangle_rotation>=90)
-                turret_rectangle_rotation=90;
+            rotateTurret(TURRET_FAST_STEP, 1);
             break;
         case GLFW_KEY_D:
-            turret_rectangle_rotation-=5;
-            if(turret_rectangle_rotation<=-90)
-                turret_rectangle_rotation=-90;
+            rotateTurret(TURRET_FAST_STEP, -1);
             break;
         case GLFW_KEY_UP:
            zoom+=0.1;
@@ -530,11 +1372,6 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
     switch (key) {
     case 'Q':
     case 'q':
-        if(score > 100)
-            cout << "YOU WON" << endl;
-        if(score < 100)
-            cout << "YOU LOST" << endl;
-        cout << score << endl;
         quit(window);
         break;
     default:
@@ -548,6 +1385,14 @@ pair<float, float> toRelativeCoords (float screen_x, float screen_y) {
     return make_pair((8.0 * screen_x / width) - 4, 4 - (8.0 * screen_y / height));
 }
 
+/* Point an idle laser at the cursor. A replay being played back sets the
+   laser's direction from the recording, so live aiming is left out then. */
+void aimCursor (float x, float y)
+{
+    if (laserFlag==0 && !options.play_path)
+        aimAt(x, y, laser_dx, laser_dy);
+}
+
 void cursorMove (GLFWwindow *window, double scree_x, double scree_y) {
 
     // Convert screen coords to world coords
@@ -558,8 +1403,7 @@ void cursorMove (GLFWwindow *window, double scree_x, double scree_y) {
     CURSOR_X = x, CURSOR_Y = y;
 
     // Orient the cannon appropriately
-    turret_angle = atan( (y - turrety) / (x + 4)) * 180.0f / M_PI;
-    if (laserFlag==0) laser_rotation = turret_angle;
+    aimCursor(x, y);
 
     // Handle clicking on the buckets and cannon
     if (redbucket_clicked)
@@ -573,6 +1417,9 @@ void cursorMove (GLFWwindow *window, double scree_x, double scree_y) {
 
 /* Executed when window is resized to 'width' and 'height' */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+/* Runs on the main thread, the render thread picks the new size up in applyViewport */
+atomic<int> framebuffer_width(0), framebuffer_height(0);
+
 void reshapeWindow (GLFWwindow* window, int width, int height)
 {
     int fbwidth=width, fbheight=height;
@@ -583,7 +1430,8 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     GLfloat fov = 90.0f;
 
     // sets the viewport of openGL renderer
-    glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+    framebuffer_width = fbwidth;
+    framebuffer_height = fbheight;
 
     // set the projection matrix as perspective
     /* glMatrixMode (GL_PROJECTION);
@@ -593,8 +1441,26 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     // Perspective projection for 3D views
     // Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
+    // Ortho projection for 2D views is set up per frame in draw()
+}
+
+/* Render thread side of reshapeWindow */
+int viewport_width = 0, viewport_height = 0;
+
+bool viewportStale ()
+{
+    return viewport_width != framebuffer_width || viewport_height != framebuffer_height;
+}
+
+bool applyViewport ()
+{
+    if (!viewportStale())
+        return false;
+    viewport_width = framebuffer_width;
+    viewport_height = framebuffer_height;
+    if (renderer->gl_draws)
+        glViewport (0, 0, (GLsizei) viewport_width, (GLsizei) viewport_height);
+    return true;
 }
 
 void scroll_callback (GLFWwindow *window, double xoffset, double yoffset) {
@@ -618,13 +1484,8 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
             //    triangle_rot_dir *= -1;
             if (action == GLFW_PRESS)
             {
-                float temp_angle= atan((CURSOR_Y-turrety)/(CURSOR_X+4))*180.0f/M_PI;
-                if(laserFlag==0)
-                    laserFlag=1;
-                turret_rectangle_rotation=temp_angle;
-                laser_rotation=temp_angle;
-                laser_x=-4;
-                laser_y=turrety;
+                aimAt(CURSOR_X, CURSOR_Y, turret_dx, turret_dy);
+                fire_requested = true;
             }
             break;
         case GLFW_MOUSE_BUTTON_RIGHT:
@@ -654,7 +1515,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 }
 
 //VAO *triangle, *rectangle;
-VAO  *triangle, *red_rectangle, *green_rectangle, *turret_rectangle,*mirror1, *mirror2, *mirror3, *mirror4, *rectangle[3],*laser;
+unique_ptr<VAO> red_rectangle, green_rectangle, turret_rectangle, mirror, laser, laser_path;
 //vector <VAO*> rectangle;
 // Creates the triangle object used in this sample code
 //void createTriangle ()
@@ -693,19 +1554,8 @@ void createRedRectangle ()
 
     };
 
-    static const GLfloat color_buffer_data [] = {
-        1,0,0, // color 1
-        1,0,0, // color 2
-        1,0,0, // color 3
-
-        1,0,0, // color 3
-        1,0,0, // color 4
-        1,0,0,  // color 1
-
-    };
-
     // create3DObject creates and returns a handle to a VAO that can be used later
-    red_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    red_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 1, 0, 0, GL_FILL);
 }
 
 void createLaser()
@@ -721,20 +1571,11 @@ void createLaser()
 
     };
 
-    static const GLfloat color_buffer_data [] = {
-        0.6,0.2,0.9, // color 1
-        0.6,0.2,0.9,
-        0.6,0.2,0.9,
-        0.6,0.2,0.9,
-        0.6,0.2,0.9,
-        0.6,0.2,0.9,
-    };
-
     // create3DObject creates and returns a handle to a VAO that can be used later
-    laser = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    laser = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.6, 0.2, 0.9, GL_FILL);
 }
 
-void createMirror1 ()
+void createMirror ()
 {
     // GL3 accepts only Triangles. Quads are not supported
     static const GLfloat vertex_buffer_data [] = {
@@ -748,196 +1589,404 @@ void createMirror1 ()
 
     };
 
-    static const GLfloat color_buffer_data [] = {
-        0,0,0, // color 1
-        0,0,0, // color 2
-        0,0,0, // color 3
-
-        0,0,0, // color 3
-        0,0,0, // color 4
-        0,0,0,  // color 1
-
-    };
-
     // create3DObject creates and returns a handle to a VAO that can be used later
-    mirror1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    mirror = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0, 0, 0, GL_FILL);
 }
 
-void createMirror2 ()
+void createGreenRectangle ()
 {
     // GL3 accepts only Triangles. Quads are not supported
     static const GLfloat vertex_buffer_data [] = {
-        -0.4,-0.05,0, // vertex 1
-        0.4,-0.05,0, // vertex 2
-        0.4, 0.05,0, // vertex 3
-
-        0.4, 0.05,0, // vertex 3
-        -0.4, 0.05,0, // vertex 4
-        -0.4,-0.05,0,  // vertex 1
 
-    };
-
-    static const GLfloat color_buffer_data [] = {
-        0,0,0, // color 1
-        0,0,0, // color 2
-        0,0,0, // color 3
-
-        0,0,0, // color 3
-        0,0,0, // color 4
-        0,0,0,  // color 1
+        -0.8,-0.25,0, // vertex 1
+        0.8,-0.25,0, // vertex 2
+        0.8, 0.25,0, // vertex 3
 
+        0.8, 0.25,0, // vertex 3
+        -0.8, 0.25,0, // vertex 4
+        -0.8,-0.25,0,  // vertex 1
     };
 
     // create3DObject creates and returns a handle to a VAO that can be used later
-    mirror2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    green_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0, 1, 0, GL_FILL);
 }
 
-void createMirror3 ()
+void CreateTurret()
 {
-    // GL3 accepts only Triangles. Quads are not supported
     static const GLfloat vertex_buffer_data [] = {
-        -0.4,-0.05,0, // vertex 1
-        0.4,-0.05,0, // vertex 2
-        0.4, 0.05,0, // vertex 3
-
-        0.4, 0.05,0, // vertex 3
-        -0.4, 0.05,0, // vertex 4
-        -0.4,-0.05,0,  // vertex 1
-
-    };
 
-    static const GLfloat color_buffer_data [] = {
-        0,0,0, // color 1
-        0,0,0, // color 2
-        0,0,0, // color 3
+        -0.3,0.05,0, // vertex 1
+        0.3,0.05,0, // vertex 2
+        0.3,-0.05,0, // vertex 3
 
-        0,0,0, // color 3
-        0,0,0, // color 4
-        0,0,0,  // color 1
+        0.3,-0.05,0, // vertex 3
+        -0.3,-0.05,0, // vertex 4
+        -0.3,0.05,0,  // vertex 1
 
     };
 
     // create3DObject creates and returns a handle to a VAO that can be used later
-    mirror3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    turret_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.23, 0.23, 1.23, GL_FILL);
+
 }
 
-void createMirror4 ()
-{
-    // GL3 accepts only Triangles. Quads are not supported
-    static const GLfloat vertex_buffer_data [] = {
-        -0.4,-0.05,0, // vertex 1
-        0.4,-0.05,0, // vertex 2
-        0.4, 0.05,0, // vertex 3
+/**************************
+ * World snapshots        *
+ **************************/
 
-        0.4, 0.05,0, // vertex 3
-        -0.4, 0.05,0, // vertex 4
-        -0.4,-0.05,0,  // vertex 1
+/* A laser's route from the turret through its mirror bounces, see traceLaser */
+#define MAX_LASER_BOUNCES 8
+#define MAX_LASER_POINTS (MAX_LASER_BOUNCES+2)
 
-    };
+struct LaserPath {
+    int count;
+    Scalar x[MAX_LASER_POINTS], y[MAX_LASER_POINTS];
+};
+
+LaserPath aim_preview;      // where a shot fired now would go
+LaserPath laser_beam;       // a hitscan shot, shown for a few ticks after firing
+
+/* Everything draw() needs, copied out of the simulation once per tick so
+   the render thread never reads globals the simulation is changing */
+struct WorldSnapshot {
+    long tick;
+    float screen_x, screen_y, zoom;
+    int laserFlag;
+    float laser_x, laser_y, laser_dx, laser_dy;
+    float redx, greenx, turrety, turret_dx, turret_dy;
+    LaserPath aim_preview, laser_beam;
+    vector <float> mirror_x, mirror_y;
+    // Blocks are copied only when block_generation changes, see captureSnapshot
+    long block_generation;
+    float fall_distance;
+    vector <float> block_x;
+    vector <float> block_base_y;
+    vector <int> block_color;
+
+    WorldSnapshot () : block_generation(-1) {}
+};
 
-    static const GLfloat color_buffer_data [] = {
-        0,0,0, // color 1
-        0,0,0, // color 2
-        0,0,0, // color 3
+/* Lock-free triple buffer handing snapshots from the simulation (writer)
+   to the render thread (reader). Each side owns one slot; the third sits
+   in middle and is swapped in and out atomically. */
+struct SnapshotBuffer {
+    static const int FRESH = 4;     // set in middle when it holds an unread snapshot
 
-        0,0,0, // color 3
-        0,0,0, // color 4
-        0,0,0,  // color 1
+    WorldSnapshot slots[3];
+    atomic<int> middle;
+    int back, front;
 
-    };
+    SnapshotBuffer () : middle(1), back(0), front(2) {}
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    mirror4 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+    WorldSnapshot& writeSlot () { return slots[back]; }
 
-void createGreenRectangle ()
+    void publish () {
+        back = middle.exchange(back | FRESH, memory_order_acq_rel) & 3;
+    }
+
+    /* True while a snapshot the reader has not acquired is waiting */
+    bool hasFresh () const {
+        return (middle.load(memory_order_acquire) & FRESH) != 0;
+    }
+
+    /* Returns true if a newer snapshot than the current front was taken */
+    bool acquire () {
+        if (!(middle.load(memory_order_acquire) & FRESH))
+            return false;
+        front = middle.exchange(front, memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const WorldSnapshot& readSlot () const { return slots[front]; }
+} snapshots;
+
+void captureSnapshot (WorldSnapshot &world, long tick)
 {
-    // GL3 accepts only Triangles. Quads are not supported
-    static const GLfloat vertex_buffer_data [] = {
+    world.tick = tick;
+    world.screen_x = screen_x;
+    world.screen_y = screen_y;
+    world.zoom = zoom;
+    world.laserFlag = laserFlag;
+    world.laser_x = toFloat(laser_x);
+    world.laser_y = toFloat(laser_y);
+    world.laser_dx = toFloat(laser_dx);
+    world.laser_dy = toFloat(laser_dy);
+    world.redx = toFloat(redx);
+    world.greenx = toFloat(greenx);
+    world.turrety = toFloat(turrety);
+    world.turret_dx = toFloat(turret_dx);
+    world.turret_dy = toFloat(turret_dy);
+    world.aim_preview = aim_preview;
+    world.laser_beam = laser_beam;
+    // assign() reuses the slot's capacity, so this does not allocate once warmed up
+    world.mirror_x.resize(mirror_x.size());
+    world.mirror_y.resize(mirror_y.size());
+    for (int i=0; i<mirror_x.size(); i++) {
+        world.mirror_x[i] = toFloat(mirror_x[i]);
+        world.mirror_y[i] = toFloat(mirror_y[i]);
+    }
+    world.fall_distance = toFloat(fall_distance);
+    if (world.block_generation != block_generation) {
+        world.block_x.resize(block_x.size());
+        world.block_base_y.resize(block_base_y.size());
+        for (int i=0; i<block_x.size(); i++) {
+            world.block_x[i] = toFloat(block_x[i]);
+            world.block_base_y[i] = toFloat(block_base_y[i]);
+        }
+        world.block_color.assign(block_color.begin(), block_color.end());
+        world.block_generation = block_generation;
+    }
+}
 
-        -0.8,-0.25,0, // vertex 1
-        0.8,-0.25,0, // vertex 2
-        0.8, 0.25,0, // vertex 3
+/* CPU side transforms are packed 2x3 matrices, [a c x; b d y], rather than
+   glm::mat4. The kind of transform is a template argument, so each kind is
+   compiled to only the arithmetic it needs: a translation skips the 2x2
+   part entirely and a rotation uses just its cosine and sine. */
+enum TransformKind { TRANSFORM_TRANSLATE, TRANSFORM_ROTATE, TRANSFORM_AFFINE };
 
-        0.8, 0.25,0, // vertex 3
-        -0.8, 0.25,0, // vertex 4
-        -0.8,-0.25,0,  // vertex 1
-    };
+struct Affine2D {
+    float a, b, c, d, x, y;
+};
 
-    static const GLfloat color_buffer_data [] = {
+/* Rotate by (c,s), then translate by (x,y), as in an ObjectInstance */
+Affine2D rigidTransform (float c, float s, float x, float y)
+{
+    Affine2D m = { c, s, -s, c, x, y };
+    return m;
+}
 
-        0,1,0, // color 1
-        0,1,0, // color 2
-        0,1,0, // color 3
+template <TransformKind kind>
+inline void transformPoint (const Affine2D &m, float px, float py, float &x, float &y);
 
-        0,1,0, // color 3
-        0,1,0, // color 4
-        0,1,0  // color 1
-    };
+template <>
+inline void transformPoint<TRANSFORM_TRANSLATE> (const Affine2D &m, float px, float py, float &x, float &y)
+{
+    x = px + m.x;
+    y = py + m.y;
+}
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    green_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+template <>
+inline void transformPoint<TRANSFORM_ROTATE> (const Affine2D &m, float px, float py, float &x, float &y)
+{
+    x = m.a*px - m.b*py + m.x;
+    y = m.b*px + m.a*py + m.y;
 }
 
-void CreateTurret()
+template <>
+inline void transformPoint<TRANSFORM_AFFINE> (const Affine2D &m, float px, float py, float &x, float &y)
 {
-    static const GLfloat vertex_buffer_data [] = {
+    x = m.a*px + m.c*py + m.x;
+    y = m.b*px + m.d*py + m.y;
+}
 
-        -0.3,0.05,0, // vertex 1
-        0.3,0.05,0, // vertex 2
-        0.3,-0.05,0, // vertex 3
+/* draw() does not make GL calls object by object. Each object pushes a
+   RenderCommand onto the render queue, the queue is sorted by key, and each
+   run of commands with the same mesh becomes one instanced draw, so more
+   objects of a kind cost no extra draw calls. The key sorts by layer first,
+   which stands in for the depth test: the whole scene is at z = 0 and
+   later layers are drawn over earlier ones. */
+enum RenderLayer { LAYER_LASER, LAYER_BASKETS, LAYER_TURRET, LAYER_MIRRORS, LAYER_BLOCKS, LAYER_OVERLAY };
+enum RenderProgram { PROGRAM_OBJECTS, PROGRAM_BLOCKS };
+enum RenderMesh { MESH_LASER, MESH_AIM_PREVIEW, MESH_LASER_BEAM, MESH_RED_BASKET, MESH_GREEN_BASKET,
+                  MESH_TURRET, MESH_MIRROR, MESH_BLOCKS, NUM_RENDER_MESHES };
+
+/* Attribute 3 of Sample_GL.vert: rotate by (c,s), then translate by (x,y) */
+struct ObjectInstance {
+    GLfloat c, s, x, y;
+};
 
-        0.3,-0.05,0, // vertex 3
-        -0.3,-0.05,0, // vertex 4
-        -0.3,0.05,0,  // vertex 1
+struct RenderCommand {
+    uint64_t key;               // layer 8 bits, program 8, mesh 16, depth 16, push order 16
+    ObjectInstance instance;
+};
 
-    };
+struct RenderQueue {
+    vector <RenderCommand> commands, scratch;
+    vector <ObjectInstance> instances;      // in sorted order, uploaded once per frame
+    GLuint instance_buffer;
+    int capacity;                           // instances the buffer holds
+    int draw_calls;                         // this frame, for --profile
+    int blocks_culled, mirrors_culled;      // likewise, left out as off screen
+} render_queue;
 
-    static const GLfloat color_buffer_data [] = {
+void createRenderQueue ()
+{
+    if (renderer->gl_draws)
+        glGenBuffers (1, &render_queue.instance_buffer);
+    render_queue.capacity = 0;
+    // A frame pushes each mesh at most once, apart from the level's mirrors
+    size_t max_commands = NUM_RENDER_MESHES + level.header->num_mirrors;
+    render_queue.commands.reserve(max_commands);
+    render_queue.scratch.reserve(max_commands);
+    render_queue.instances.reserve(max_commands);
+}
 
-        0.23,0.23,1.23, // color 1
-        0.23,0.23,1.23, // color 2
-        0.23,0.23,1.23, // color 3
+void pushRender (RenderLayer layer, RenderProgram program, RenderMesh mesh, float x, float y,
+                 float c=1, float s=0, uint16_t depth=0)
+{
+    RenderCommand command;
+    command.key = (uint64_t) layer << 56 | (uint64_t) program << 48 | (uint64_t) mesh << 32 |
+                  (uint64_t) depth << 16 | (render_queue.commands.size() & 0xffff);
+    command.instance.c = c;
+    command.instance.s = s;
+    command.instance.x = x;
+    command.instance.y = y;
+    render_queue.commands.push_back(command);
+}
 
-        0.23,0.23,1.23, // color 1
-        0.23,0.23,1.23, // color 2
-        0.23,0.23,1.23,//color 1
-    };
+/* LSD radix sort on the keys, a byte per pass. Passes where every key has
+   the same byte, which is most of them for a queue this size, are skipped. */
+void sortRenderQueue ()
+{
+    vector <RenderCommand> &commands = render_queue.commands, &scratch = render_queue.scratch;
+    size_t n = commands.size();
+    if (n < 2)
+        return;
+    scratch.resize(n);
+    for (int shift=0; shift<64; shift+=8) {
+        size_t counts[256] = {};
+        for (size_t i=0; i<n; i++)
+            counts[(commands[i].key >> shift) & 255]++;
+        if (counts[(commands[0].key >> shift) & 255] == n)
+            continue;
+        size_t offset = 0;
+        for (int b=0; b<256; b++) {
+            size_t count = counts[b];
+            counts[b] = offset;
+            offset += count;
+        }
+        for (size_t i=0; i<n; i++)
+            scratch[counts[(commands[i].key >> shift) & 255]++] = commands[i];
+        commands.swap(scratch);
+    }
+}
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    turret_rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* Object transforms form a small hierarchy. Each node holds its transform
+   relative to its parent and a cached world transform, both as the rotate
+   then translate pair of an ObjectInstance. Giving a node a new local
+   transform marks it dirty, and updateScene() recomputes only dirty nodes
+   and their descendants, so a frame where just the turret turns touches
+   just the turret. Parents are always added before their children. */
+struct SceneNode {
+    int parent;                 // -1 for a root
+    ObjectInstance local, world;
+    bool dirty;                 // local changed since the last updateScene()
+    bool moved;                 // world was recomputed by the last updateScene()
+};
 
+struct SceneGraph {
+    vector <SceneNode> nodes;
+    int turret_pivot, turret;   // the turret turns about its left end, 0.3 behind its centre
+    int red_basket, green_basket;
+    int first_mirror;           // then one node per level mirror
+    int updated;                // nodes recomputed by the last updateScene(), for --profile
+} scene;
+
+int addSceneNode (int parent, float x, float y, float c=1, float s=0)
+{
+    SceneNode node;
+    node.parent = parent;
+    node.local.c = c;
+    node.local.s = s;
+    node.local.x = x;
+    node.local.y = y;
+    node.world = node.local;
+    node.dirty = true;
+    node.moved = false;
+    scene.nodes.push_back(node);
+    return scene.nodes.size() - 1;
 }
 
-void CreateRedBlock()
+void setSceneNode (int node, float x, float y, float c, float s)
 {
-    static const GLfloat vertex_buffer_data [] = {
+    ObjectInstance &local = scene.nodes[node].local;
+    if (local.x == x && local.y == y && local.c == c && local.s == s)
+        return;
+    local.c = c;
+    local.s = s;
+    local.x = x;
+    local.y = y;
+    scene.nodes[node].dirty = true;
+}
 
-        -0.3,0.2,0, // vertex 1
-        0.3,0.2,0, // vertex 2
-        0.3,-0.2,0, // vertex 3
+void moveSceneNode (int node, float x, float y)
+{
+    const ObjectInstance &local = scene.nodes[node].local;
+    setSceneNode(node, x, y, local.c, local.s);
+}
 
-        0.3,-0.2,0, // vertex 3
-        -0.3,-0.2,0, // vertex 4
-        -0.3,0.2,0,  // vertex 1
+/* Built once the level is loaded; the mirrors keep their level angle */
+void createScene ()
+{
+    scene.nodes.clear();
+    scene.turret_pivot = addSceneNode(-1, -4, 0);
+    scene.turret = addSceneNode(scene.turret_pivot, 0.3, 0);
+    float basket_c = cos(rectangle_rotation*M_PI/180.0f), basket_s = sin(rectangle_rotation*M_PI/180.0f);
+    scene.red_basket = addSceneNode(-1, 0, -3.45, basket_c, basket_s);
+    scene.green_basket = addSceneNode(-1, 0, -3.45, basket_c, basket_s);
+    scene.first_mirror = scene.nodes.size();
+    for (int i=0; i<level.header->num_mirrors; i++) {
+        float angle = level.mirrors[i].angle*M_PI/180.0f;
+        addSceneNode(-1, 0, 0, cos(angle), sin(angle));
+    }
+}
 
-    };
+void updateScene ()
+{
+    scene.updated = 0;
+    for (int i=0; i<scene.nodes.size(); i++) {
+        SceneNode &node = scene.nodes[i];
+        node.moved = node.dirty || (node.parent >= 0 && scene.nodes[node.parent].moved);
+        node.dirty = false;
+        if (!node.moved)
+            continue;
+        if (node.parent < 0)
+            node.world = node.local;
+        else {
+            const ObjectInstance &p = scene.nodes[node.parent].world, &l = node.local;
+            node.world.c = p.c*l.c - p.s*l.s;
+            node.world.s = p.s*l.c + p.c*l.s;
+            node.world.x = p.x + p.c*l.x - p.s*l.y;
+            node.world.y = p.y + p.s*l.x + p.c*l.y;
+        }
+        scene.updated++;
+    }
+}
 
-    static const GLfloat color_buffer_data [] = {
+void pushSceneNode (RenderLayer layer, RenderProgram program, RenderMesh mesh, int node)
+{
+    const ObjectInstance &world = scene.nodes[node].world;
+    pushRender(layer, program, mesh, world.x, world.y, world.c, world.s);
+}
 
-        1,0,0, // color 1
-        1,0,0, // color 1
-        1,0,0, // color 1
+/* Blocks are drawn with one instanced call. The instance buffer holds each
+   block's x, height and kind and is rewritten only when blocks spawn or are
+   removed; Block.vert moves them all down by the fall distance. Heights are
+   stored relative to the fall distance at upload so they stay small. */
+struct BlockInstance {
+    GLfloat x, y, kind;
+};
 
-        1,0,0, // color 1
-        1,0,0, // color 1
-        1,0,0, // color 1
-    };
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    rectangle[0] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
+static const GLfloat BLOCK_PALETTE[3][3] = {
+    { 1, 0, 0 },    // red
+    { 0, 1, 0 },    // green
+    { 0, 0, 0 },    // black
+};
+
+struct BlockBatch {
+    unique_ptr<VAO> mesh;           // one block, attribute 2 comes from instance_buffer
+    GLuint instance_buffer;
+    int count, capacity;            // instances uploaded, instances the buffer holds
+    long generation;                // block_generation of the uploaded instances
+    float origin;                   // fall distance the uploaded heights are relative to
+    vector <BlockInstance> staging;
+    vector <int> visible, culling;  // indices of the uploaded blocks, and scratch for the next cull
 
-void createGreenBlock()
+    GLuint programID;
+    GLint VPID, FallDistanceID;
+} blocks;
+
+void createBlocks ()
 {
     static const GLfloat vertex_buffer_data [] = {
 
@@ -951,46 +2000,144 @@ void createGreenBlock()
 
     };
 
-    static const GLfloat color_buffer_data [] = {
+    blocks.count = blocks.capacity = 0;
+    blocks.generation = -1;
+    size_t max_blocks = maxLiveBlocks(*level.header);
+    blocks.staging.reserve(max_blocks);
+    blocks.visible.reserve(max_blocks);
+    blocks.culling.reserve(max_blocks);
 
-        0,1,0, // color 1
-        0,1,0, // color 1
-        0,1,0, // color 1
-        0,1,0, // color 1
-        0,1,0, // color 1
-        0,1,0, // color 1
+    // createVertexArray leaves the new VAO bound for the instance attribute
+    blocks.mesh = createVertexArray(GL_TRIANGLES, 6, vertex_buffer_data, GL_FILL);
+    if (!renderer->gl_draws)
+        return;
 
-    };
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    rectangle[1] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    glGenBuffers (1, &blocks.instance_buffer);
+    glBindBuffer (GL_ARRAY_BUFFER, blocks.instance_buffer);
+    glVertexAttribPointer(
+                2,                      // attribute 2. Block instance
+                3,                      // size (x,y,kind)
+                GL_FLOAT,               // type
+                GL_FALSE,               // normalized?
+                sizeof(BlockInstance),  // stride
+                (void*)0                // array buffer offset
+                );
+    glVertexAttribDivisor(2, 1);        // advance once per block, not per vertex
+    glEnableVertexAttribArray(2);
 }
 
-void createBlackBlock()
-{
-    static const GLfloat vertex_buffer_data [] = {
+/* The area the camera shows, in world units */
+struct ViewRect {
+    float left, right, bottom, top;
+};
 
-        -0.3,0.2,0, // vertex 1
-        0.3,0.2,0, // vertex 2
-        0.3,-0.2,0, // vertex 3
+#define BLOCK_HALF_WIDTH 0.3f
+#define BLOCK_HALF_HEIGHT 0.2f
+#define MIRROR_RADIUS 0.41f     // a mirror at any angle fits in this circle
 
-        0.3,-0.2,0, // vertex 3
-        -0.3,-0.2,0, // vertex 4
-        -0.3,0.2,0,  // vertex 1
+/* Indices of the blocks that overlap view. The block arrays are already
+   structure of arrays, so SSE tests four blocks per iteration; the scalar
+   loop does the rest, and everything on machines without SSE2. */
+void cullBlocks (const WorldSnapshot &world, const ViewRect &view, vector <int> &visible)
+{
+    float left = view.left - BLOCK_HALF_WIDTH, right = view.right + BLOCK_HALF_WIDTH;
+    float bottom = view.bottom - BLOCK_HALF_HEIGHT, top = view.top + BLOCK_HALF_HEIGHT;
+    const float *xs = world.block_x.data(), *base_ys = world.block_base_y.data();
+    int n = world.block_x.size(), i = 0;
+    visible.clear();
+#ifdef __SSE2__
+    __m128 left4 = _mm_set1_ps(left), right4 = _mm_set1_ps(right);
+    __m128 bottom4 = _mm_set1_ps(bottom), top4 = _mm_set1_ps(top);
+    __m128 fall4 = _mm_set1_ps(world.fall_distance);
+    for (; i+4 <= n; i+=4) {
+        __m128 x = _mm_loadu_ps(xs + i);
+        __m128 y = _mm_sub_ps(_mm_loadu_ps(base_ys + i), fall4);
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(x, left4), _mm_cmplt_ps(x, right4)),
+                                   _mm_and_ps(_mm_cmpgt_ps(y, bottom4), _mm_cmplt_ps(y, top4)));
+        for (int mask = _mm_movemask_ps(inside); mask; mask &= mask - 1)
+            visible.push_back(i + __builtin_ctz(mask));
+    }
+#endif
+    for (; i<n; i++) {
+        float x = xs[i], y = base_ys[i] - world.fall_distance;
+        if (x > left && x < right && y > bottom && y < top)
+            visible.push_back(i);
+    }
+}
 
-    };
+/* Upload the blocks of this snapshot that are in view, if they are not the
+   ones already uploaded. Blocks fall continuously, but the visible set only
+   changes when one crosses the edge of the view or blocks spawn or go. */
+void uploadBlocks (const WorldSnapshot &world, const ViewRect &view)
+{
+    cullBlocks(world, view, blocks.culling);
+    render_queue.blocks_culled += world.block_x.size() - blocks.culling.size();
+    if (world.block_generation == blocks.generation && blocks.culling == blocks.visible)
+        return;
+    blocks.visible.swap(blocks.culling);
+    int n = blocks.visible.size();
+    blocks.origin = world.fall_distance;
+    blocks.staging.resize(n);
+    for (int i=0; i<n; i++) {
+        int block = blocks.visible[i];
+        BlockInstance &instance = blocks.staging[i];
+        instance.x = world.block_x[block];
+        instance.y = world.block_base_y[block] - blocks.origin;
+        instance.kind = world.block_color[block];
+    }
 
-    static const GLfloat color_buffer_data [] = {
+    glBindBuffer (GL_ARRAY_BUFFER, blocks.instance_buffer);
+    if (n > blocks.capacity)
+        blocks.capacity = max(n, 2*blocks.capacity);
+    // Orphan the old storage so frames still in flight keep reading it
+    glBufferData (GL_ARRAY_BUFFER, blocks.capacity*sizeof(BlockInstance), NULL, GL_DYNAMIC_DRAW);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, n*sizeof(BlockInstance), blocks.staging.data());
+    blocks.count = n;
+    blocks.generation = world.block_generation;
+}
 
-        0,0,0, // color 1
-        0,0,0, // color 1
-        0,0,0, // color 1
-        0,0,0, // color 1
-        0,0,0, // color 1
-        0,0,0, // color 1
+void drawBlocks (const WorldSnapshot &world, const ViewRect &view, const glm::mat4 &VP)
+{
+    uploadBlocks(world, view);
+    if (blocks.count == 0)
+        return;
+    glUseProgram (blocks.programID);
+    glUniformMatrix4fv(blocks.VPID, 1, GL_FALSE, &VP[0][0]);
+    glUniform1f(blocks.FallDistanceID, world.fall_distance - blocks.origin);
+    glPolygonMode (GL_FRONT_AND_BACK, blocks.mesh->FillMode);
+    glBindVertexArray (blocks.mesh->VertexArrayID);
+    glDrawArraysInstanced(blocks.mesh->PrimitiveMode, 0, blocks.mesh->NumVertices, blocks.count);
+    render_queue.draw_calls++;
+    glUseProgram (programID);
+}
 
-    };
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    rectangle[2] = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+/* Line strip rewritten from a LaserPath every time it is drawn */
+void createLaserPath ()
+{
+    laser_path = createVertexArray(GL_LINE_STRIP, MAX_LASER_POINTS, NULL, GL_LINE);
+}
+
+void drawLaserPath (const LaserPath &path, GLfloat red, GLfloat green, GLfloat blue)
+{
+    if (path.count < 2)
+        return;
+    GLfloat vertices[3*MAX_LASER_POINTS];
+    for (int i=0; i<path.count; i++) {
+        vertices[3*i] = toFloat(path.x[i]);
+        vertices[3*i+1] = toFloat(path.y[i]);
+        vertices[3*i+2] = 0;
+    }
+    glBindBuffer (GL_ARRAY_BUFFER, laser_path->VertexBuffer);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, 3*path.count*sizeof(GLfloat), vertices);
+
+    // Already in world space: no instance buffer, the identity instead
+    glVertexAttrib4f(3, 1, 0, 0, 0);
+    laser_path->Color[0] = red;
+    laser_path->Color[1] = green;
+    laser_path->Color[2] = blue;
+    laser_path->NumVertices = path.count;
+    draw3DObject(laser_path.get());
+    render_queue.draw_calls++;
 }
 
 //float camera_rotation_angle = 90;
@@ -1023,172 +2170,655 @@ void createBlackBlock()
     }
 }*/
 
-void draw ()
+const VAO* renderMesh (RenderMesh mesh)
 {
-    glClearColor(0.3,0.1,0.2,0.7);
-    // clear the color and depth in the frame buffer
-    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    switch (mesh) {
+    case MESH_LASER: return laser.get();
+    case MESH_RED_BASKET: return red_rectangle.get();
+    case MESH_GREEN_BASKET: return green_rectangle.get();
+    case MESH_TURRET: return turret_rectangle.get();
+    case MESH_MIRROR: return mirror.get();
+    default: return NULL;
+    }
+}
+
+/* Draw count instances of vao, starting at instance first of this frame's upload */
+void drawInstanced (const VAO *vao, int first, int count)
+{
+    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    glBindVertexArray (vao->VertexArrayID);
+    if (!vao->ColorBuffer)
+        glVertexAttrib3f(1, vao->Color[0], vao->Color[1], vao->Color[2]);
+    glBindBuffer (GL_ARRAY_BUFFER, render_queue.instance_buffer);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(ObjectInstance), (void*) (first*sizeof(ObjectInstance)));
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
+    glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, count);
+    render_queue.draw_calls++;
+}
+
+/* Sort the frame's commands and draw them, one call per run of a mesh */
+void flushRenderQueue (const WorldSnapshot &world, const ViewRect &view, const glm::mat4 &VP)
+{
+    RenderQueue &q = render_queue;
+    sortRenderQueue();
+    int n = q.commands.size();
+    q.instances.resize(n);
+    for (int i=0; i<n; i++)
+        q.instances[i] = q.commands[i].instance;
+    glBindBuffer (GL_ARRAY_BUFFER, q.instance_buffer);
+    if (n > q.capacity)
+        q.capacity = max(n, 2*q.capacity);
+    // Orphan the old storage so frames still in flight keep reading it
+    glBufferData (GL_ARRAY_BUFFER, q.capacity*sizeof(ObjectInstance), NULL, GL_STREAM_DRAW);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, n*sizeof(ObjectInstance), q.instances.data());
 
-    // use the loaded shader program
-    // Don't change unless you know what you are doing
     glUseProgram (programID);
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &VP[0][0]);
+    for (int i=0; i<n; ) {
+        uint64_t run = q.commands[i].key >> 32;     // layer, program and mesh
+        int end = i + 1;
+        while (end < n && q.commands[end].key >> 32 == run)
+            end++;
+        RenderMesh mesh = (RenderMesh) (run & 0xffff);
+        if (mesh == MESH_BLOCKS)
+            drawBlocks(world, view, VP);
+        else if (mesh == MESH_AIM_PREVIEW)
+            drawLaserPath(world.aim_preview, 0.45, 0.35, 0.55);
+        else if (mesh == MESH_LASER_BEAM)
+            drawLaserPath(world.laser_beam, 0.6, 0.2, 0.9);
+        else
+            drawInstanced(renderMesh(mesh), i, end - i);
+        i = end;
+    }
+    q.commands.clear();
+}
 
-    // Eye - Location of camera. Don't change unless you are sure!!
-    glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-    glm::vec3 target (0, 0, 0);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-    glm::vec3 up (0, 1, 0);
+/* An offscreen color buffer, drawn over the viewport as one quad */
+struct RenderTarget {
+    GLuint framebuffer, texture;
+    int width, height;              // 0 until first sized
+};
 
-    // Compute Camera matrix (view)
-    // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-    //  Don't change unless you are sure!!
-    Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+struct Compositor {
+    unique_ptr<VAO> quad;           // covers the viewport, already in clip space
+    GLuint programID;               // Composite.vert/.frag
+    GLint LayerID;
+} compositor;
 
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP = Matrices.projection * Matrices.view;
+void createCompositor ()
+{
+    static const GLfloat vertex_buffer_data [] = {
+        -1,-1,0, 1,-1,0, 1,1,0,
+        1,1,0, -1,1,0, -1,-1,0,
+    };
+    compositor.quad = createVertexArray(GL_TRIANGLES, 6, vertex_buffer_data, GL_FILL);
+}
 
-    // Send our transformation to the currently bound shader, in the "MVP" uniform
-    // For each model you render, since the MVP will be different (at least the M part)
-    //  Don't change unless you are sure!!
-    glm::mat4 MVP;	// MVP = Projection * View * Model
+/* filter is how the texture is sampled when drawn at another size */
+void createRenderTarget (RenderTarget &target, GLint filter)
+{
+    glGenFramebuffers (1, &target.framebuffer);
+    glGenTextures (1, &target.texture);
+    glBindTexture (GL_TEXTURE_2D, target.texture);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    target.width = target.height = 0;
+}
 
-    // Load identity to model matrix
-    //Matrices.model = glm::mat4(1.0f);
+/* Returns true if the target had to be reallocated, losing its contents */
+bool resizeRenderTarget (RenderTarget &target, int width, int height)
+{
+    if (target.width == width && target.height == height)
+        return false;
+    target.width = width;
+    target.height = height;
+    glBindTexture (GL_TEXTURE_2D, target.texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glBindFramebuffer (GL_FRAMEBUFFER, target.framebuffer);
+    glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    glBindFramebuffer (GL_FRAMEBUFFER, 0);
+    return true;
+}
 
-    /* Render your scene */
+void drawRenderTarget (const RenderTarget &target)
+{
+    glUseProgram (compositor.programID);
+    glActiveTexture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D, target.texture);
+    glPolygonMode (GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray (compositor.quad->VertexArrayID);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+    render_queue.draw_calls++;
+    glUseProgram (programID);
+}
 
-    //glm::mat4 translateTriangle = glm::translate (glm::vec3(-2.0f, 0.0f, 0.0f)); // glTranslatef
-    //glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-    //glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
-    //Matrices.model *= triangleTransform;
-    //MVP = VP * Matrices.model; // MVP = p * V * M
+void destroyRenderTarget (RenderTarget &target)
+{
+    glDeleteFramebuffers(1, &target.framebuffer);
+    glDeleteTextures(1, &target.texture);
+}
 
-    //  Don't change unless you are sure!!
-    //glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    //draw3DObject(triangle);
-
-    // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-    // glPopMatrix ();
-    //float screen_left,screen_right,screen_top,screen_bottom;
-    screen_left=(screen_x-4.0)/zoom;
-    screen_right=(4.0+screen_x)/zoom;
-    screen_top=-(screen_y-4.0)/zoom;
-    screen_bottom=-(4+screen_y)/zoom;
-    Matrices.projection = glm::ortho(screen_left, screen_right, screen_bottom, screen_top, 0.1f, 500.0f);
+/* Dynamic resolution: when the GPU cannot keep up, the playfield is drawn
+   into a smaller offscreen target and stretched over the window, while the
+   overlay (the laser's aim lines) stays at full resolution. GPU time per
+   frame comes from timer queries, and once per GOVERNOR_SAMPLES frames
+   the governor moves at most one step: down when the slowest tenth of the
+   frames used most of the budget, up only when the step above is expected
+   to leave a wide margin. The gap between the two thresholds is what
+   keeps it from oscillating.
+
+   The budget is a frame at --fps when there is a cap, and otherwise a
+   refresh of the monitor the window is on, which is what vsync paces to.
+   If the monitor does not report its rate the budget is GOVERNOR_DEFAULT_HZ. */
+static const float RESOLUTION_STEPS[] = { 1.0f, 0.85f, 0.7f, 0.6f, 0.5f };
+#define NUM_RESOLUTION_STEPS (int) (sizeof(RESOLUTION_STEPS)/sizeof(RESOLUTION_STEPS[0]))
+#define GOVERNOR_SAMPLES 60
+#define GOVERNOR_DOWN 0.8       // of the frame budget at the 90th percentile
+#define GOVERNOR_UP 0.55        // expected at the next step up, fill cost goes with area
+#define GOVERNOR_DEFAULT_HZ 60
+#define TIMER_QUERIES (MAX_FRAMES_IN_FLIGHT+1)
+
+int display_refresh_hz = 0;     // of the window's monitor, 0 if unknown; set by initGLFW
+
+struct ResolutionGovernor {
+    int step;                       // into RESOLUTION_STEPS
+    float gpu_ms[GOVERNOR_SAMPLES];
+    int samples;
+    GLuint queries[TIMER_QUERIES];
+    bool pending[TIMER_QUERIES];    // query issued, result not read yet
+    RenderTarget playfield;         // used below full scale
+} governor;
+
+float resolutionScale ()
+{
+    return RESOLUTION_STEPS[governor.step];
+}
 
-    if(laserFlag==1)
-    {
-        Matrices.model = glm::mat4(1.0f);
+void createGovernor ()
+{
+    ResolutionGovernor &g = governor;
+    g.step = 0;
+    g.samples = 0;
+    glGenQueries (TIMER_QUERIES, g.queries);
+    for (int i=0; i<TIMER_QUERIES; i++)
+        g.pending[i] = false;
+    createRenderTarget(g.playfield, GL_LINEAR);
+}
 
-        glm::mat4 translateLaser = glm::translate (glm::vec3(laser_x, laser_y, 0));        // glTranslatef
-        glm::mat4 rotateLaser = glm::rotate((float)(laser_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-        Matrices.model *= (translateLaser * rotateLaser);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+void governorSample (float gpu_ms)
+{
+    ResolutionGovernor &g = governor;
+    g.gpu_ms[g.samples++] = gpu_ms;
+    if (g.samples < GOVERNOR_SAMPLES)
+        return;
+    g.samples = 0;
+    if (!options.dynamic_resolution)
+        return;
+
+    float *p90 = g.gpu_ms + GOVERNOR_SAMPLES*9/10;
+    nth_element(g.gpu_ms, p90, g.gpu_ms + GOVERNOR_SAMPLES);
+    int hz = options.target_fps > 0 ? options.target_fps : display_refresh_hz > 0 ? display_refresh_hz : GOVERNOR_DEFAULT_HZ;
+    float budget = 1000.0f / hz;
+    float scale = RESOLUTION_STEPS[g.step];
+    if (*p90 > GOVERNOR_DOWN*budget && g.step < NUM_RESOLUTION_STEPS-1)
+        g.step++;
+    else if (g.step > 0) {
+        float up = RESOLUTION_STEPS[g.step-1] / scale;
+        if (*p90 * up*up < GOVERNOR_UP*budget)
+            g.step--;
+    }
+}
 
-        draw3DObject(laser);
+/* Bracket a frame's GL commands; results are read TIMER_QUERIES frames later so this never waits */
+void beginFrameTiming (long frame)
+{
+    ResolutionGovernor &g = governor;
+    int slot = frame % TIMER_QUERIES;
+    if (g.pending[slot]) {
+        GLint available = 0;
+        glGetQueryObjectiv(g.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(g.queries[slot], GL_QUERY_RESULT, &ns);
+            governorSample(ns / 1e6f);
+        }
     }
+    glBeginQuery (GL_TIME_ELAPSED, g.queries[slot]);
+    g.pending[slot] = true;
+}
 
-    Matrices.model = glm::mat4(1.0f);
+void endFrameTiming ()
+{
+    glEndQuery (GL_TIME_ELAPSED);
+}
 
-    glm::mat4 translateRedRectangle = glm::translate (glm::vec3(redx, -3.45, 0));        // glTranslatef
-    glm::mat4 rotateRedRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateRedRectangle * rotateRedRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Camera for this snapshot: the ortho view rectangle and its matrix */
+ViewRect viewOf (const WorldSnapshot &world, glm::mat4 &VP)
+{
+    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+    //  Don't change unless you are sure!!
+    Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+    float screen_left=(world.screen_x-4.0)/world.zoom;
+    float screen_right=(4.0+world.screen_x)/world.zoom;
+    float screen_top=-(world.screen_y-4.0)/world.zoom;
+    float screen_bottom=-(4+world.screen_y)/world.zoom;
+    Matrices.projection = glm::ortho(screen_left, screen_right, screen_bottom, screen_top, 0.1f, 500.0f);
 
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(red_rectangle);
+    VP = Matrices.projection * Matrices.view;
+    ViewRect view = { screen_left, screen_right, screen_bottom, screen_top };
+    return view;
+}
 
-    Matrices.model = glm::mat4(1.0f);
+/* Move the scene's nodes to where this snapshot has the objects. A mirror
+   with no path gets the same position every frame, so its node stays clean
+   and is only culled. Static mirrors are drawn into every frame after the
+   clear rather than cached in an offscreen texture: on llvmpipe compositing
+   a viewport-sized texture costs far more than the clear and the few
+   mirrors it would save. */
+void placeScene (const WorldSnapshot &world)
+{
+    setSceneNode(scene.turret_pivot, -4, world.turrety, world.turret_dx, world.turret_dy);
+    moveSceneNode(scene.red_basket, world.redx, -3.45);
+    moveSceneNode(scene.green_basket, world.greenx, -3.45);
+    for (int i=0; i<world.mirror_x.size(); i++)
+        moveSceneNode(scene.first_mirror + i, world.mirror_x[i], world.mirror_y[i]);
+    updateScene();
+}
 
-    glm::mat4 translateGreenRectangle = glm::translate (glm::vec3(greenx, -3.45, 0));        // glTranslatef
-    glm::mat4 rotateGreenRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateGreenRectangle * rotateGreenRectangle);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* The playfield's objects, drawn in layer order over the cleared background */
+void queuePlayfield (const WorldSnapshot &world, const ViewRect &view)
+{
+    if(world.laserFlag==1)
+        pushRender(LAYER_LASER, PROGRAM_OBJECTS, MESH_LASER, world.laser_x, world.laser_y, world.laser_dx, world.laser_dy);
 
-    // draw3DObject draws the VAO given to it using current MVP matrix
+    placeScene(world);
+    pushSceneNode(LAYER_BASKETS, PROGRAM_OBJECTS, MESH_RED_BASKET, scene.red_basket);
+    pushSceneNode(LAYER_BASKETS, PROGRAM_OBJECTS, MESH_GREEN_BASKET, scene.green_basket);
+    pushSceneNode(LAYER_TURRET, PROGRAM_OBJECTS, MESH_TURRET, scene.turret);
 
-    draw3DObject(green_rectangle);
+    for(int i=0;i<world.mirror_x.size();i++)
+    {
+        const ObjectInstance &mirror = scene.nodes[scene.first_mirror + i].world;
+        if(mirror.x + MIRROR_RADIUS < view.left || mirror.x - MIRROR_RADIUS > view.right ||
+           mirror.y + MIRROR_RADIUS < view.bottom || mirror.y - MIRROR_RADIUS > view.top)
+        {
+            render_queue.mirrors_culled++;
+            continue;
+        }
+        pushSceneNode(LAYER_MIRRORS, PROGRAM_OBJECTS, MESH_MIRROR, scene.first_mirror + i);
+    }
 
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translateTurretRectangle1 = glm::translate (glm::vec3(0.3, 0, 0));
-    glm::mat4 translateTurretRectangle = glm::translate (glm::vec3(-4.0, turrety, 0));        // glTranslatef
-    glm::mat4 rotateTurretRectangle = glm::rotate((float)(turret_rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateTurretRectangle * rotateTurretRectangle * translateTurretRectangle1);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    pushRender(LAYER_BLOCKS, PROGRAM_BLOCKS, MESH_BLOCKS, 0, 0);
+}
 
-    draw3DObject(turret_rectangle);
+/* Drawn at full resolution over the playfield */
+void queueOverlay ()
+{
+    pushRender(LAYER_OVERLAY, PROGRAM_OBJECTS, MESH_AIM_PREVIEW, 0, 0);
+    pushRender(LAYER_OVERLAY, PROGRAM_OBJECTS, MESH_LASER_BEAM, 0, 0);
+}
 
-    Matrices.model = glm::mat4(1.0f);
+void draw (const WorldSnapshot &world)
+{
+    glm::mat4 VP;
+    ViewRect view = viewOf(world, VP);
+
+    // Below full scale the playfield goes to an offscreen target first
+    float scale = resolutionScale();
+    RenderTarget *playfield = scale < 1 ? &governor.playfield : NULL;
+    int width = viewport_width, height = viewport_height;
+    if (playfield) {
+        width = max(1, (int) (viewport_width*scale));
+        height = max(1, (int) (viewport_height*scale));
+        resizeRenderTarget(*playfield, width, height);
+    }
 
-    glm::mat4 translateMirror1 = glm::translate (glm::vec3(-1.7, 2, 0));        // glTranslatef
-    glm::mat4 rotateMirror1 = glm::rotate((float)(135*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateMirror1 * rotateMirror1);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    glBindFramebuffer (GL_FRAMEBUFFER, playfield ? playfield->framebuffer : 0);
+    glViewport (0, 0, width, height);
 
-    draw3DObject(mirror1);
+    // Only color is cleared, the render queue's layers take the place of depth
+    glClearColor(0.3,0.1,0.2,0.7);
+    glClear (GL_COLOR_BUFFER_BIT);
 
-    Matrices.model = glm::mat4(1.0f);
+    queuePlayfield(world, view);
+    flushRenderQueue(world, view, VP);
 
-    glm::mat4 translateMirror2 = glm::translate (glm::vec3(-0.3, -1, 0));        // glTranslatef
-    glm::mat4 rotateMirror2 = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateMirror2 * rotateMirror2);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    // Stretch the playfield over the window, then the overlay at full resolution on top
+    if (playfield) {
+        glBindFramebuffer (GL_FRAMEBUFFER, 0);
+        glViewport (0, 0, viewport_width, viewport_height);
+        drawRenderTarget(*playfield);
+    }
+    queueOverlay();
+    flushRenderQueue(world, view, VP);
+}
 
-    draw3DObject(mirror2);
+/**************************
+ * Software rasterizer    *
+ **************************/
 
-    Matrices.model = glm::mat4(1.0f);
+/* With --software every frame is rasterized on the CPU from the same render
+   queue as the GL path. GL is used only to show the result, since GLFW has
+   no other way to put pixels in a window: the frame is uploaded to a texture
+   and copied to the back buffer with one glBlitFramebuffer, so an OpenGL 3.0
+   context is enough and no shaders, VAOs or timer queries are created.
+   Triangles are binned into SOFT_TILE square tiles and a pool of threads
+   fills the tiles in parallel, four pixels at a time with SSE2 edge
+   functions. Each tile clears itself and draws its triangles in queue order,
+   so there is no depth buffer. */
+
+#define SOFT_TILE 64
+#define SOFT_LINE_WIDTH 1.5f            // laser paths, in pixels
+#define SOFT_CLEAR_COLOR 0xb2331a4du    // glClearColor(0.3,0.1,0.2,0.7) as RGBA8
+
+struct SoftTriangle {
+    float x[3], y[3];                   // in pixels, y up, counter-clockwise
+    uint32_t color;                     // RGBA8 in memory order
+};
 
-    glm::mat4 translateMirror3 = glm::translate (glm::vec3(1.7, 3.0, 0));        // glTranslatef
-    glm::mat4 rotateMirror3 = glm::rotate((float)(0*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateMirror3 * rotateMirror3);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+struct SoftwareRenderer {
+    int width, height;
+    int stride;                         // pixels per row, whole tiles so SSE never runs off a row
+    int tiles_x, tiles_y;
+    vector <uint32_t> pixels;           // the frame, bottom row first like a GL texture
+    vector <SoftTriangle> triangles;
+    size_t max_triangles;               // a frame of this level never bins more
+    vector <vector <int> > bins;        // per tile, the triangles overlapping it in draw order
+    vector <int> visible;               // blocks in view
+    RenderTarget target;                // the frame is uploaded here and blitted from
+
+    vector <thread> workers;
+    mutex lock;
+    condition_variable start, done;
+    long pass;                          // bumped to start the workers on a pass
+    int busy;                           // workers not yet done with it
+    atomic<int> next_tile;
+    bool stop;
+} software;
+
+uint32_t packColor (float red, float green, float blue)
+{
+    uint32_t r = min(max(red, 0.0f), 1.0f)*255 + 0.5f;
+    uint32_t g = min(max(green, 0.0f), 1.0f)*255 + 0.5f;
+    uint32_t b = min(max(blue, 0.0f), 1.0f)*255 + 0.5f;
+    return r | g << 8 | b << 16 | 0xff000000u;
+}
 
-    draw3DObject(mirror3);
+/* Bins a triangle given in pixels, any winding */
+void softTriangle (float x0, float y0, float x1, float y1, float x2, float y2, uint32_t color)
+{
+    SoftwareRenderer &r = software;
+    float area = (x1 - x0)*(y2 - y0) - (y1 - y0)*(x2 - x0);
+    if (area == 0)
+        return;
+    if (area < 0) {
+        swap(x1, x2);
+        swap(y1, y2);
+    }
+    int tx0 = max(0, (int) floor(min(x0, min(x1, x2))) / SOFT_TILE);
+    int tx1 = min(r.tiles_x - 1, (int) ceil(max(x0, max(x1, x2))) / SOFT_TILE);
+    int ty0 = max(0, (int) floor(min(y0, min(y1, y2))) / SOFT_TILE);
+    int ty1 = min(r.tiles_y - 1, (int) ceil(max(y0, max(y1, y2))) / SOFT_TILE);
+    if (tx0 > tx1 || ty0 > ty1)
+        return;
+
+    SoftTriangle t = { { x0, x1, x2 }, { y0, y1, y2 }, color };
+    int index = r.triangles.size();
+    r.triangles.push_back(t);
+    for (int ty=ty0; ty<=ty1; ty++)
+        for (int tx=tx0; tx<=tx1; tx++)
+            r.bins[ty*r.tiles_x + tx].push_back(index);
+}
 
-    Matrices.model = glm::mat4(1.0f);
+/* The triangles of a mesh, rotated by (c,s) and moved to (x,y) in world space */
+template <TransformKind kind>
+void softMesh (const VAO *vao, const ViewRect &view, const Affine2D &m, uint32_t color)
+{
+    const SoftwareRenderer &r = software;
+    float sx = r.width / (view.right - view.left), sy = r.height / (view.top - view.bottom);
+    float px[3], py[3];
+    for (int i=0; i+2 < vao->NumVertices; i+=3) {
+        for (int k=0; k<3; k++) {
+            const GLfloat *v = vao->Vertices + 3*(i + k);
+            transformPoint<kind>(m, v[0], v[1], px[k], py[k]);
+            px[k] = (px[k] - view.left)*sx;
+            py[k] = (py[k] - view.bottom)*sy;
+        }
+        softTriangle(px[0], py[0], px[1], py[1], px[2], py[2], color);
+    }
+}
 
-    glm::mat4 translateMirror4 = glm::translate (glm::vec3(2.7, mirror_y, 0));        // glTranslatef
-    glm::mat4 rotateMirror4 = glm::rotate((float)(90*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-    Matrices.model *= (translateMirror4 * rotateMirror4);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* A laser path as a strip of SOFT_LINE_WIDTH wide quads */
+void softLaserPath (const LaserPath &path, const ViewRect &view, uint32_t color)
+{
+    const SoftwareRenderer &r = software;
+    float sx = r.width / (view.right - view.left), sy = r.height / (view.top - view.bottom);
+    for (int i=0; i+1 < path.count; i++) {
+        float ax = (toFloat(path.x[i]) - view.left)*sx, ay = (toFloat(path.y[i]) - view.bottom)*sy;
+        float bx = (toFloat(path.x[i+1]) - view.left)*sx, by = (toFloat(path.y[i+1]) - view.bottom)*sy;
+        float length = sqrt((bx - ax)*(bx - ax) + (by - ay)*(by - ay));
+        if (length == 0)
+            continue;
+        float nx = -(by - ay) / length * SOFT_LINE_WIDTH/2, ny = (bx - ax) / length * SOFT_LINE_WIDTH/2;
+        softTriangle(ax + nx, ay + ny, bx + nx, by + ny, bx - nx, by - ny, color);
+        softTriangle(bx - nx, by - ny, ax - nx, ay - ny, ax + nx, ay + ny, color);
+    }
+}
 
-    draw3DObject(mirror4);
+void softBlocks (const WorldSnapshot &world, const ViewRect &view)
+{
+    SoftwareRenderer &r = software;
+    cullBlocks(world, view, r.visible);
+    render_queue.blocks_culled += world.block_x.size() - r.visible.size();
+    for (int i=0; i<r.visible.size(); i++) {
+        int block = r.visible[i];
+        const GLfloat *color = BLOCK_PALETTE[world.block_color[block]];
+        Affine2D place = rigidTransform(1, 0, world.block_x[block], world.block_base_y[block] - world.fall_distance);
+        softMesh<TRANSFORM_TRANSLATE>(blocks.mesh.get(), view, place, packColor(color[0], color[1], color[2]));
+    }
+}
 
-    Matrices.model = glm::mat4(1.0f);
+/* Fill one tile: the clear color, then every triangle binned to it */
+void rasterizeTile (int tile)
+{
+    SoftwareRenderer &r = software;
+    int x0 = tile % r.tiles_x * SOFT_TILE, y0 = tile / r.tiles_x * SOFT_TILE;
+    int x1 = x0 + SOFT_TILE, y1 = min(y0 + SOFT_TILE, r.height);
+    for (int y=y0; y<y1; y++)
+        fill_n(&r.pixels[y*r.stride + x0], SOFT_TILE, SOFT_CLEAR_COLOR);
+
+    const vector <int> &bin = r.bins[tile];
+    for (int b=0; b<bin.size(); b++) {
+        const SoftTriangle &t = r.triangles[bin[b]];
+        // Edge i runs from vertex i to the next; inside is where all three are >= 0
+        float A[3], B[3], C[3];
+        for (int i=0; i<3; i++) {
+            int j = (i + 1) % 3;
+            A[i] = -(t.y[j] - t.y[i]);
+            B[i] = t.x[j] - t.x[i];
+            C[i] = (t.y[j] - t.y[i])*t.x[i] - (t.x[j] - t.x[i])*t.y[i];
+        }
+        int bx0 = max(x0, (int) floor(min(t.x[0], min(t.x[1], t.x[2])))) & ~3;
+        int bx1 = min(x1, (int) ceil(max(t.x[0], max(t.x[1], t.x[2]))) + 1);
+        int by0 = max(y0, (int) floor(min(t.y[0], min(t.y[1], t.y[2]))));
+        int by1 = min(y1, (int) ceil(max(t.y[0], max(t.y[1], t.y[2]))) + 1);
+        for (int y=by0; y<by1; y++) {
+            float py = y + 0.5f;
+            uint32_t *row = &r.pixels[y*r.stride];
+            int x = bx0;
+#ifdef __SSE2__
+            __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f), zero = _mm_setzero_ps();
+            __m128i color = _mm_set1_epi32(t.color);
+            for (; x < bx1; x+=4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float) x), offsets);
+                __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[0]), px), _mm_set1_ps(B[0]*py + C[0])), zero);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[1]), px), _mm_set1_ps(B[1]*py + C[1])), zero));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[2]), px), _mm_set1_ps(B[2]*py + C[2])), zero));
+                __m128i mask = _mm_castps_si128(inside);
+                __m128i *dst = (__m128i*) (row + x);
+                _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(mask, color), _mm_andnot_si128(mask, _mm_loadu_si128(dst))));
+            }
+#endif
+            for (; x < bx1; x++) {
+                float px = x + 0.5f;
+                if (A[0]*px + B[0]*py + C[0] >= 0 && A[1]*px + B[1]*py + C[1] >= 0 && A[2]*px + B[2]*py + C[2] >= 0)
+                    row[x] = t.color;
+            }
+        }
+    }
+}
 
-    int i;
-    for(i=0;i<block_x.size();i++)
+void rasterizeTiles ()
+{
+    SoftwareRenderer &r = software;
+    for (int tile; (tile = r.next_tile++) < r.tiles_x*r.tiles_y; )
+        rasterizeTile(tile);
+}
+
+void softwareWorker ()
+{
+    SoftwareRenderer &r = software;
+    long pass = 0;
+    while (true) {
+        {
+            unique_lock<mutex> lock(r.lock);
+            r.start.wait(lock, [&] { return r.pass != pass || r.stop; });
+            if (r.stop)
+                return;
+            pass = r.pass;
+        }
+        rasterizeTiles();
+        lock_guard<mutex> lock(r.lock);
+        if (--r.busy == 0)
+            r.done.notify_one();
+    }
+}
+
+/* Turn the queued commands into triangles and fill every tile, the render thread helping the workers */
+void rasterizeQueue (const WorldSnapshot &world, const ViewRect &view)
+{
+    SoftwareRenderer &r = software;
+    sortRenderQueue();
+    r.triangles.clear();
+    for (int i=0; i<r.bins.size(); i++)
+        r.bins[i].clear();
+    for (int i=0; i<render_queue.commands.size(); i++) {
+        const RenderCommand &command = render_queue.commands[i];
+        const ObjectInstance &o = command.instance;
+        RenderMesh mesh = (RenderMesh) (command.key >> 32 & 0xffff);
+        if (mesh == MESH_BLOCKS)
+            softBlocks(world, view);
+        else if (mesh == MESH_AIM_PREVIEW)
+            softLaserPath(world.aim_preview, view, packColor(0.45, 0.35, 0.55));
+        else if (mesh == MESH_LASER_BEAM)
+            softLaserPath(world.laser_beam, view, packColor(0.6, 0.2, 0.9));
+        else {
+            const VAO *vao = renderMesh(mesh);
+            uint32_t color = packColor(vao->Color[0], vao->Color[1], vao->Color[2]);
+            // Baskets and unturned mirrors are axis aligned
+            if (o.c == 1 && o.s == 0)
+                softMesh<TRANSFORM_TRANSLATE>(vao, view, rigidTransform(o.c, o.s, o.x, o.y), color);
+            else
+                softMesh<TRANSFORM_ROTATE>(vao, view, rigidTransform(o.c, o.s, o.x, o.y), color);
+        }
+    }
+    render_queue.commands.clear();
+
+    r.next_tile = 0;
     {
-        Matrices.model = glm::mat4(1.0f);
+        lock_guard<mutex> lock(r.lock);
+        r.pass++;
+        r.busy = r.workers.size();
+    }
+    r.start.notify_all();
+    rasterizeTiles();
+    unique_lock<mutex> lock(r.lock);
+    r.done.wait(lock, [&] { return r.busy == 0; });
+}
 
-        glm::mat4 translateRectangle = glm::translate (glm::vec3(block_x[i], block_y[i], 0));        // glTranslatef
-        glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-        Matrices.model *= (translateRectangle * rotateRectangle);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Each object mesh once, a mirror per level mirror, every live block and two per laser path segment */
+size_t softTriangleLimit ()
+{
+    size_t triangles = 0;
+    for (int mesh=0; mesh<NUM_RENDER_MESHES; mesh++)
+        if (renderMesh((RenderMesh) mesh))
+            triangles += renderMesh((RenderMesh) mesh)->NumVertices/3;
+    triangles += level.header->num_mirrors * (mirror->NumVertices/3);
+    triangles += maxLiveBlocks(*level.header) * (blocks.mesh->NumVertices/3);
+    triangles += 2 * 2*(MAX_LASER_POINTS - 1);
+    return triangles;
+}
 
-        // draw3DObject draws the VAO given to it using current MVP matrix
-        draw3DObject(rectangle[block_color[i]]);
+void startSoftwareRenderer ()
+{
+    SoftwareRenderer &r = software;
+    r.width = r.height = 0;
+    r.pass = 0;
+    r.stop = false;
+    r.max_triangles = softTriangleLimit();
+    r.triangles.reserve(r.max_triangles);
+    r.visible.reserve(maxLiveBlocks(*level.header));
+    createRenderTarget(r.target, GL_NEAREST);
+    int threads = max(1u, thread::hardware_concurrency());
+    for (int i=1; i<threads; i++)     // the render thread is the other one
+        r.workers.push_back(thread(softwareWorker));
+}
+
+void stopSoftwareRenderer ()
+{
+    SoftwareRenderer &r = software;
+    {
+        lock_guard<mutex> lock(r.lock);
+        r.stop = true;
     }
+    r.start.notify_all();
+    for (int i=0; i<r.workers.size(); i++)
+        r.workers[i].join();
+    r.workers.clear();
+    destroyRenderTarget(r.target);
+}
 
-    // Increment angles
-    float increments = 1;
+void resizeSoftwareRenderer (int width, int height)
+{
+    SoftwareRenderer &r = software;
+    if (r.width == width && r.height == height)
+        return;
+    r.width = width;
+    r.height = height;
+    r.tiles_x = (width + SOFT_TILE - 1) / SOFT_TILE;
+    r.tiles_y = (height + SOFT_TILE - 1) / SOFT_TILE;
+    r.stride = r.tiles_x * SOFT_TILE;
+    r.pixels.assign(r.stride*height, 0);
+    r.bins.resize(r.tiles_x*r.tiles_y);
+    for (int i=0; i<r.bins.size(); i++)
+        r.bins[i].reserve(r.max_triangles);
+    resizeRenderTarget(r.target, width, height);
+}
 
-    //camera_rotation_angle++; // Simulating camera rotation
-    //triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-    //rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+/* The software counterpart of draw() */
+void drawSoftware (const WorldSnapshot &world)
+{
+    SoftwareRenderer &r = software;
+    glm::mat4 VP;
+    ViewRect view = viewOf(world, VP);
+    resizeSoftwareRenderer(max(1, viewport_width), max(1, viewport_height));
+
+    queuePlayfield(world, view);
+    queueOverlay();
+    rasterizeQueue(world, view);
+
+    // A plain copy to the back buffer, no shaders or geometry involved
+    glBindTexture (GL_TEXTURE_2D, r.target.texture);
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, r.stride);
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE, r.pixels.data());
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, r.target.framebuffer);
+    glBlitFramebuffer (0, 0, r.width, r.height, 0, 0, r.width, r.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, 0);
+    render_queue.draw_calls++;
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1197,26 +2827,44 @@ GLFWwindow* initGLFW (int width, int height)
 {
     GLFWwindow* window; // window desciptor/handle
 
+    StartupTimer timer("initGLFW");
     glfwSetErrorCallback(error_callback);
     if (!glfwInit()) {
         //        exit(EXIT_FAILURE);
     }
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    int major = renderer->gl_major, minor = renderer->gl_minor;
+#ifdef __APPLE__
+    // Mac OS X has no 3.0 or 3.1 context, only 2.1 and 3.2 core or later
+    if (major == 3 && minor < 2)
+        minor = 2;
+#endif
+    if (major == 0)
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    else {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+    }
+    if (major*10 + minor >= 32) {
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    }
 
-    window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+    window = glfwCreateWindow(width, height, "Brick Breaker", NULL, NULL);
 
     if (!window) {
         glfwTerminate();
         //        exit(EXIT_FAILURE);
     }
 
-    glfwMakeContextCurrent(window);
-    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    // The context is made current on the render thread, see renderLoop
+
+    // Monitor queries are main thread only, so the governor's refresh rate is read here
+    GLFWmonitor *monitor = window ? glfwGetWindowMonitor(window) : NULL;
+    if (!monitor)
+        monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode *mode = monitor ? glfwGetVideoMode(monitor) : NULL;
+    display_refresh_hz = mode ? mode->refreshRate : 0;
 
     /* --- register callbacks with GLFW --- */
 
@@ -1243,357 +2891,3263 @@ GLFWwindow* initGLFW (int width, int height)
     // Register function to handle mouse scroll
     glfwSetScrollCallback(window, scroll_callback);
 
+    // Register function to pause rendering when the window loses focus
+    glfwSetWindowFocusCallback(window, windowFocus);
+
 
     return window;
 }
 
+void bindUniforms ()
+{
+    Matrices.MatrixID = glGetUniformLocation(programID, "VP");
+}
+
+void bindBlockUniforms ()
+{
+    blocks.VPID = glGetUniformLocation(blocks.programID, "VP");
+    blocks.FallDistanceID = glGetUniformLocation(blocks.programID, "fallDistance");
+    // The palette never changes, so it is set once per link
+    glUseProgram (blocks.programID);
+    glUniform3fv(glGetUniformLocation(blocks.programID, "palette"), 3, &BLOCK_PALETTE[0][0]);
+    glUseProgram (programID);
+}
+
+void bindCompositeUniforms ()
+{
+    compositor.LayerID = glGetUniformLocation(compositor.programID, "layer");
+    glUseProgram (compositor.programID);
+    glUniform1i(compositor.LayerID, 0);     // texture unit 0
+    glUseProgram (programID);
+}
+
+/* Everything draw() needs besides the meshes: the compositor, offscreen target, timer queries and shaders */
+void startGLRenderer ()
+{
+    {
+        StartupTimer timer("create targets", "render");
+        createCompositor();
+        createGovernor();
+    }
+    // Create and compile our GLSL program from the shaders
+    {
+        StartupTimer timer("LoadShaders", "render");
+        programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
+        blocks.programID = LoadShaders( "Block.vert", "Sample_GL.frag" );
+        compositor.programID = LoadShaders( "Composite.vert", "Composite.frag" );
+    }
+    // Get a handle for our "MVP" uniform
+    bindUniforms();
+    bindBlockUniforms();
+    bindCompositeUniforms();
+#ifdef DEV_BUILD
+    watchShaders(&programID, "Sample_GL.vert", "Sample_GL.frag", bindUniforms);
+    watchShaders(&blocks.programID, "Block.vert", "Sample_GL.frag", bindBlockUniforms);
+    watchShaders(&compositor.programID, "Composite.vert", "Composite.frag", bindCompositeUniforms);
+#endif
+}
+
+void stopGLRenderer ()
+{
+    compositor.quad.reset();
+    destroyRenderTarget(governor.playfield);
+    glDeleteQueries(TIMER_QUERIES, governor.queries);
+    glDeleteProgram(programID);
+    glDeleteProgram(blocks.programID);
+    glDeleteProgram(compositor.programID);
+}
+
+/* Release the GL objects while the context is still current */
+void destroyGL ()
+{
+    red_rectangle.reset();
+    green_rectangle.reset();
+    turret_rectangle.reset();
+    mirror.reset();
+    laser.reset();
+    laser_path.reset();
+    blocks.mesh.reset();
+    if (renderer->gl_draws) {
+        glDeleteBuffers(1, &render_queue.instance_buffer);
+        glDeleteBuffers(1, &blocks.instance_buffer);
+    }
+    renderer->stop();
+}
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
-void initGL (GLFWwindow* window, int width, int height)
+void initGL (GLFWwindow* window)
 {
     /* Objects should be created before any other gl function and shaders */
     // Create the models
     //createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
-    createRedRectangle ();
-    createGreenRectangle();
-    CreateTurret();
-    createMirror1();
-    createMirror2();
-    createMirror3();
-    createMirror4();
-    createBlackBlock();
-    createGreenBlock();
-    CreateRedBlock();
-    createLaser();
-    // Create and compile our GLSL program from the shaders
-    programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-    // Get a handle for our "MVP" uniform
-    Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
-
-
-    reshapeWindow (window, width, height);
+    {
+        StartupTimer timer("create meshes", "render");
+        createRedRectangle ();
+        createGreenRectangle();
+        CreateTurret();
+        createMirror();
+        createBlocks();
+        createLaser();
+        createLaserPath();
+        createRenderQueue();
+        createScene();
+    }
+    renderer->start();
+    if (!renderer->gl_major)
+        return;
 
     // Background color of the scene
     glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
-    glClearDepth (1.0f);
 
-    glEnable (GL_DEPTH_TEST);
-    glDepthFunc (GL_LEQUAL);
+    // No depth test, the render queue draws the scene back to front
+    glDisable (GL_DEPTH_TEST);
 
+    StartupTimer timer("driver info", "render");
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
     cout << "VERSION: " << glGetString(GL_VERSION) << endl;
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+    renderer_device = (const char*) glGetString(GL_RENDERER);
 }
 
-int main (int argc, char** argv)
-{
+/**************************
+ * Scoring rules          *
+ **************************/
 
-    mpg123_handle *mh;
-    unsigned char *buffer;
-    size_t buffer_size;
-    size_t done;
-    int err;
+/* Block kinds, as stored in block_color */
+enum BlockKind { RED_BLOCK = 0, GREEN_BLOCK = 1, BLACK_BLOCK = 2, NUM_BLOCK_KINDS };
 
-    int driver;
-    ao_device *dev;
+/* Baskets under a block while it is in the basket band, as a bit mask */
+enum BasketHit { HIT_NONE = 0, HIT_RED = 1, HIT_GREEN = 2, HIT_BOTH = 3, NUM_BASKET_HITS };
 
-    ao_sample_format format;
-    int channels, encoding;
-    long rate;
+struct ScoreOutcome {
+    int score;      // added to score
+    int consumed;   // 1 if the block is removed from play
+    int black;      // added to numberOfBlack
+};
 
-    // if(argc < 2)
-    //   exit(0);
+/* Red and green blocks score in their own basket, lose in the other one and cancel out in both */
+template <int Kind> struct BlockRules {
+    static constexpr int own = (Kind == RED_BLOCK) ? HIT_RED : HIT_GREEN;
+    static constexpr ScoreOutcome outcome (int hit) {
+        return hit == HIT_NONE ? ScoreOutcome{0, 0, 0}      // keeps falling
+             : hit == HIT_BOTH ? ScoreOutcome{0, 1, 0}
+             : hit == own      ? ScoreOutcome{20, 1, 0}
+             :                   ScoreOutcome{-30, 1, 0};
+    }
+};
 
-    /* initializations */
-    ao_initialize();
-    driver = ao_default_driver_id();
-    mpg123_init();
-    mh = mpg123_new(NULL, &err);
-    buffer_size = 3200;
-    buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
-
-    /* open the file and get the decoding format */
-    mpg123_open(mh, "q.mp3");
-    mpg123_getformat(mh, &rate, &channels, &encoding);
-
-    /* set the output format and open the output device */
-    format.bits = mpg123_encsize(encoding) * BITS;
-    format.rate = rate;
-    format.channels = channels;
-    format.byte_format = AO_FMT_NATIVE;
-    format.matrix = 0;
-    dev = ao_open_live(driver, &format, NULL);
+/* Black blocks cost points in any basket, and a little less on the ground */
+template <> struct BlockRules<BLACK_BLOCK> {
+    static constexpr ScoreOutcome outcome (int hit) {
+        return hit == HIT_NONE ? ScoreOutcome{-10, 1, 0} : ScoreOutcome{-50, 1, 1};
+    }
+};
 
+#define SCORE_ROW(kind) { BlockRules<kind>::outcome(HIT_NONE), BlockRules<kind>::outcome(HIT_RED), \
+                          BlockRules<kind>::outcome(HIT_GREEN), BlockRules<kind>::outcome(HIT_BOTH) }
 
-    int width = 600;
-    int height = 600;
+/* Indexed as SCORE_TABLE[block_color][BasketHit] */
+constexpr ScoreOutcome SCORE_TABLE[NUM_BLOCK_KINDS][NUM_BASKET_HITS] = {
+    SCORE_ROW(RED_BLOCK), SCORE_ROW(GREEN_BLOCK), SCORE_ROW(BLACK_BLOCK)
+};
 
-    window = initGLFW(width, height);
-    srand(time(NULL));
+#undef SCORE_ROW
 
-    initGL (window, width, height);
+#define CHECK_CELL(kind, hit, s, c, b) \
+    static_assert(SCORE_TABLE[kind][hit].score == (s) && SCORE_TABLE[kind][hit].consumed == (c) && \
+                  SCORE_TABLE[kind][hit].black == (b), "scoring rule " #kind " x " #hit)
 
-    laser_rotation=rectangle_rotation;
+CHECK_CELL(RED_BLOCK,   HIT_NONE,    0, 0, 0);
+CHECK_CELL(RED_BLOCK,   HIT_RED,    20, 1, 0);
+CHECK_CELL(RED_BLOCK,   HIT_GREEN, -30, 1, 0);
+CHECK_CELL(RED_BLOCK,   HIT_BOTH,    0, 1, 0);
+CHECK_CELL(GREEN_BLOCK, HIT_NONE,    0, 0, 0);
+CHECK_CELL(GREEN_BLOCK, HIT_RED,   -30, 1, 0);
+CHECK_CELL(GREEN_BLOCK, HIT_GREEN,  20, 1, 0);
+CHECK_CELL(GREEN_BLOCK, HIT_BOTH,    0, 1, 0);
+CHECK_CELL(BLACK_BLOCK, HIT_NONE,  -10, 1, 0);
+CHECK_CELL(BLACK_BLOCK, HIT_RED,   -50, 1, 1);
+CHECK_CELL(BLACK_BLOCK, HIT_GREEN, -50, 1, 1);
+CHECK_CELL(BLACK_BLOCK, HIT_BOTH,  -50, 1, 1);
 
-    double last_update_time = glfwGetTime(), current_time;
+#undef CHECK_CELL
 
-    laser_rotation=rectangle_rotation;
-    /* Draw in loop */
-    while (!glfwWindowShouldClose(window))
+/**************************
+ * Simulation             *
+ **************************/
+
+/* The game advances in fixed ticks on the main thread, independent of the render rate */
+#define SIM_HZ 60
+
+/* Blocks are scored while their centre is inside this band, and dropped below OFFSCREEN_Y */
+#define BASKET_BAND_TOP -3.1
+#define BASKET_BAND_BOTTOM -3.9
+#define OFFSCREEN_Y -4.5
+#define BASKET_HALF_WIDTH 0.8
+
+/* fall_distance is wound back by itself once past this, so it keeps its
+   precision as a float and stays in range as Q16.16 */
+#define FALL_REBASE 256
+
+/* All blocks fall together. fall_distance is how far they have fallen
+   since the round started, so block i is at block_base_y[i] - fall_distance
+   and nothing per block changes while it falls. M/N only change how fast
+   fall_distance grows, which keeps every stored block valid without a rebase.
+
+   Instead of testing every block each tick, the fall distance at which a
+   block reaches the basket band (or leaves the screen) is kept in a
+   min-heap, so a tick only touches the blocks that arrive in it plus the
+   few that are inside the band. */
+enum BlockEventKind { ENTER_BAND, LEAVE_SCREEN };
+
+struct BlockEvent {
+    Scalar fall_distance;       // when fall_distance reaches this
+    long serial;                // block it applies to, may be gone by then
+    int kind;
+
+    bool operator< (const BlockEvent &other) const {
+        return fall_distance > other.fall_distance;     // min-heap with std::push_heap
+    }
+};
+
+long next_block_serial = 0;
+vector <BlockEvent> block_events;
+vector <long> band_blocks;      // serials of blocks inside the basket band
+
+Scalar blockY (int i)
+{
+    return block_base_y[i] - fall_distance;
+}
+
+void scheduleBlockEvent (long serial, Scalar at, int kind)
+{
+    BlockEvent event = { at, serial, kind };
+    block_events.push_back(event);
+    push_heap(block_events.begin(), block_events.end());
+}
+
+void spawnBlock (Scalar x, Scalar y, int color)
+{
+    Scalar base_y = y + fall_distance;
+    block_x.push_back(x);
+    block_base_y.push_back(base_y);
+    block_color.push_back(color);
+    block_serial.push_back(next_block_serial);
+    block_generation++;
+    scheduleBlockEvent(next_block_serial, base_y - BASKET_BAND_TOP, ENTER_BAND);
+    next_block_serial++;
+}
+
+/* Index of the block with this serial, or -1. Blocks stay in spawn order so serials are sorted */
+int findBlock (long serial)
+{
+    vector <long>::iterator it = lower_bound(block_serial.begin(), block_serial.end(), serial);
+    return (it != block_serial.end() && *it == serial) ? it - block_serial.begin() : -1;
+}
+
+void removeBlock (int i)
+{
+    block_x.erase(block_x.begin()+i);
+    block_base_y.erase(block_base_y.begin()+i);
+    block_color.erase(block_color.begin()+i);
+    block_serial.erase(block_serial.begin()+i);
+    block_generation++;
+}
+
+/* Room for max_blocks blocks and their events. A block has at most one
+   event pending, and a shot or caught block's event is dropped by the time
+   the block would have left the screen, so the heap needs no more room */
+void reserveBlocks (size_t max_blocks)
+{
+    block_x.reserve(max_blocks);
+    block_base_y.reserve(max_blocks);
+    block_color.reserve(max_blocks);
+    block_serial.reserve(max_blocks);
+    block_events.reserve(max_blocks);
+    band_blocks.reserve(max_blocks);
+}
+
+/* Narrow [t0,t1], a part of this tick, to when a basket moving from x0 to x1
+   is under a block at x. Returns false if it never is. */
+bool basketOverlap (Scalar x, Scalar x0, Scalar x1, Scalar &t0, Scalar &t1)
+{
+    Scalar offset = x0 - x, velocity = x1 - x0;
+    if (velocity == 0) {
+        if (fabs(offset) > BASKET_HALF_WIDTH)
+            return false;
+    } else {
+        Scalar a = (-BASKET_HALF_WIDTH - offset)/velocity, b = (BASKET_HALF_WIDTH - offset)/velocity;
+        t0 = max(t0, min(a, b));
+        t1 = min(t1, max(a, b));
+    }
+    return t0 <= t1;
+}
+
+/* Baskets that pass under a block at x during [t0,t1] of this tick, with
+   the baskets moving in a straight line from their last tick positions.
+   If both do, the block lands in whichever got there first. */
+int sweptBasketHit (Scalar x, Scalar t0, Scalar t1)
+{
+    Scalar red_t0 = t0, red_t1 = t1, green_t0 = t0, green_t1 = t1;
+    bool red = basketOverlap(x, prev_redx, redx, red_t0, red_t1);
+    bool green = basketOverlap(x, prev_greenx, greenx, green_t0, green_t1);
+    if (!red || !green)
+        return red*HIT_RED | green*HIT_GREEN;
+    Scalar first = min(red_t0, green_t0);
+    return (red_t0 <= first)*HIT_RED | (green_t0 <= first)*HIT_GREEN;
+}
+
+/* Move every block down by one tick and score the ones over the baskets.
+   Scoring sweeps the whole tick, so a fast block that crosses the band in
+   one step, or a basket that slides under a block between ticks, still counts. */
+void moveBlocks ()
+{
+    fall_distance += blockSpeed;
+    if (fall_distance > FALL_REBASE)
     {
-        if(laser_x<-5.0 || laser_x>5.0 || laser_y>5.0 || laser_y<-5.0)
-            laserFlag=0;
-        mirror_y+=0.01;
-        if(mirror_y>2.5)
-            mirror_y=-2.5;
-        if (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
-            ao_play(dev, (char*) buffer, done);
-        else mpg123_seek(mh, 0, SEEK_SET);
+        // Shifting every height and event by the same amount keeps the heap ordered
+        for (int i=0; i<block_base_y.size(); i++)
+            block_base_y[i] -= fall_distance;
+        for (int k=0; k<block_events.size(); k++)
+            block_events[k].fall_distance -= fall_distance;
+        fall_distance = 0;
+        block_generation++;
+    }
+
+    while (!block_events.empty() && block_events.front().fall_distance <= fall_distance)
+    {
+        BlockEvent event = block_events.front();
+        pop_heap(block_events.begin(), block_events.end());
+        block_events.pop_back();
+        int i = findBlock(event.serial);
+        if (i < 0)
+            continue;   // already shot or caught
+        if (event.kind == ENTER_BAND)
+            band_blocks.push_back(event.serial);
+        else
+            removeBlock(i);
+    }
 
-        int i;
-        float x_tmp=0,head_x,head_y;
-        for(i=0;i<block_x.size();i++)
+    int live=0;
+    for(int k=0;k<band_blocks.size();k++)
+    {
+        int i = findBlock(band_blocks[k]);
+        if (i < 0)
+            continue;
+        // The block fell from y+blockSpeed to y, find the part of the tick it spent in the band
+        Scalar y = blockY(i);
+        Scalar enter = 0, leave = 1;
+        if (blockSpeed > 0) {
+            enter = max((Scalar) 0, (y + blockSpeed - (Scalar) BASKET_BAND_TOP)/blockSpeed);
+            leave = min((Scalar) 1, (y + blockSpeed - (Scalar) BASKET_BAND_BOTTOM)/blockSpeed);
+        }
+        if (enter <= leave)
         {
-            x_tmp=0;
-            if(laserFlag==1)
-            {
-                while(x_tmp>=-0.2)
-                {
-                    head_y=laser_y+(0.01*sin(laser_rotation*M_PI/180));
-                    head_x=laser_x+(0.2*cos(laser_rotation*M_PI/180))+x_tmp;
-                    if(head_x<=block_x[i]+0.31 && head_x>=block_x[i]-0.31 && head_y<=block_y[i]+0.21 && head_y>=block_y[i]-0.21)
-                    {
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                        score+=30;
-                        laserFlag=0;
-                        break;
-                    }
-                    x_tmp-=0.02;
-                }
+            const ScoreOutcome &outcome = SCORE_TABLE[block_color[i]][sweptBasketHit(block_x[i], enter, leave)];
+            score += outcome.score;
+            numberOfBlack += outcome.black;
+            if (outcome.consumed) {
+                removeBlock(i);
+                continue;
             }
         }
-        if(laserFlag==1)
+        if (y < BASKET_BAND_BOTTOM)
         {
-            double leading_point_x = (double)laser_x + ((double)0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-            double leading_point_y = (double)laser_y + ((double)0.4 / 2.0) * sin((double)laser_rotation*M_PI/180.0f);
+            // Missed both baskets, let it fall off the screen
+            scheduleBlockEvent(block_serial[i], block_base_y[i] - OFFSCREEN_Y, LEAVE_SCREEN);
+            continue;
+        }
+        band_blocks[live++] = band_blocks[k];
+    }
+    band_blocks.resize(live);
 
+    prev_redx = redx;
+    prev_greenx = greenx;
+}
 
-            double mirror_ax = -1.7 + (0.8 / 2.0) * cos(135*M_PI/180.0f);
-            double mirror_ay = 2 + (0.8 / 2.0) * sin(135*M_PI/180.0f);
-            double mirror_bx = -1.7 - (0.8 / 2.0) * cos(135*M_PI/180.0f);
-            double mirror_by = 2 - (0.8 / 2.0) * sin(135*M_PI/180.0f);
+/**************************
+ * Laser paths            *
+ **************************/
 
-            double d1 = sqrt(pow(mirror_ax - leading_point_x, 2) + pow(mirror_ay - leading_point_y, 2));
-            double d2 = sqrt(pow(mirror_bx - leading_point_x, 2) + pow(mirror_by - leading_point_y, 2));
+/* Reflect the direction (dx,dy) off mirror i: d - 2(d.n)n with n its unit normal */
+void reflect (Scalar &dx, Scalar &dy, int i)
+{
+    Scalar nx = -mirror_sin[i], ny = mirror_cos[i];
+    Scalar along = dx*nx + dy*ny;
+    dx -= 2*along*nx;
+    dy -= 2*along*ny;
+}
 
-            if (fabs(d1 + d2-0.8)<=0.02)
-            {
-                //            resetBeam();
-                laser_rotation = 2.0 * 135 - laser_rotation;
-                //cout << laser_rotation << endl;
-                laser_x = leading_point_x + (0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-                laser_y = leading_point_y + (0.4/ 2.0) * sin((double)laser_rotation*M_PI/180.0f);
-            }
+/* The laser flies in a straight line until it leaves the screen or meets a
+   mirror, where it reflects. traceLaser follows that route analytically,
+   one ray/segment intersection per mirror per bounce, instead of stepping
+   the laser along it. */
+#define LASER_BOUNDS 5.0
+#define MIRROR_HALF_LENGTH 0.4
+#define BLOCK_HIT_HALF_WIDTH 0.31
+#define BLOCK_HIT_HALF_HEIGHT 0.21
+#define BEAM_TICKS (SIM_HZ/5)
+
+/* Which mirrors a trace may bounce off */
+enum MirrorSet { ALL_MIRRORS, STATIC_MIRRORS, MOVING_MIRRORS };
+
+/* The first mirror in set that the ray from (x,y) along (dx,dy) meets
+   within distance t, skipping mirror skip. Shortens t to the hit and
+   returns the mirror, or returns -1 */
+int nearestMirror (Scalar x, Scalar y, Scalar dx, Scalar dy, Scalar &t, int skip, int set)
+{
+    int hit = -1;
+    for (int i=0; i<mirror_x.size(); i++) {
+        bool moving = level.mirrors[i].path_speed > 0;
+        if (i == skip || (set == STATIC_MIRRORS && moving) || (set == MOVING_MIRRORS && !moving))
+            continue;
+        // Solve (x,y) + ti*d = mirror centre + si*mirror direction
+        Scalar denom = dx*mirror_sin[i] - dy*mirror_cos[i];
+        if (fabs(denom) < (Scalar) 1e-6 || denom == 0)
+            continue;   // parallel
+        Scalar ex = mirror_x[i] - x, ey = mirror_y[i] - y;
+        Scalar ti = (ex*mirror_sin[i] - ey*mirror_cos[i])/denom;
+        Scalar si = (ex*dy - ey*dx)/denom;
+        if (ti > 0 && ti < t && fabs(si) <= MIRROR_HALF_LENGTH) {
+            t = ti;
+            hit = i;
         }
-        if(laserFlag==1)
-        {
-            double leading_point_x = (double)laser_x + ((double)0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-            double leading_point_y = (double)laser_y + ((double)0.4 / 2.0) * sin((double)laser_rotation*M_PI/180.0f);
-
+    }
+    return hit;
+}
 
-            double mirror_ax = -0.3 + (0.8 / 2.0) * cos(45*M_PI/180.0f);
-            double mirror_ay = -1 + (0.8 / 2.0) * sin(45*M_PI/180.0f);
-            double mirror_bx = -0.3 - (0.8 / 2.0) * cos(45*M_PI/180.0f);
-            double mirror_by = -1 - (0.8 / 2.0) * sin(45*M_PI/180.0f);
+/* Continue path from its last point along (dx,dy), having just left last_mirror */
+void extendLaser (LaserPath &path, Scalar dx, Scalar dy, int last_mirror, int set)
+{
+    Scalar x = path.x[path.count-1], y = path.y[path.count-1];
+    while (path.count < MAX_LASER_POINTS)
+    {
+        // Distance along the ray to the edge of the screen
+        Scalar t = 4*LASER_BOUNDS;     // further than any exit
+        if (dx != 0) t = min(t, ((dx > 0 ? (Scalar) LASER_BOUNDS : (Scalar) -LASER_BOUNDS) - x)/dx);
+        if (dy != 0) t = min(t, ((dy > 0 ? (Scalar) LASER_BOUNDS : (Scalar) -LASER_BOUNDS) - y)/dy);
+
+        int hit = nearestMirror(x, y, dx, dy, t, last_mirror, set);
+        x += t*dx;
+        y += t*dy;
+        path.x[path.count] = x;
+        path.y[path.count++] = y;
+        if (hit < 0)
+            break;
+        reflect(dx, dy, hit);
+        last_mirror = hit;
+    }
+}
 
-            double d1 = sqrt(pow(mirror_ax - leading_point_x, 2) + pow(mirror_ay - leading_point_y, 2));
-            double d2 = sqrt(pow(mirror_bx - leading_point_x, 2) + pow(mirror_by - leading_point_y, 2));
+void traceLaser (Scalar x, Scalar y, Scalar dx, Scalar dy, LaserPath &path, int set)
+{
+    path.count = 0;
+    path.x[path.count] = x;
+    path.y[path.count++] = y;
+    extendLaser(path, dx, dy, -1, set);
+}
 
-            if (fabs(d1 + d2-0.8)<=0.02)
-            {
-                //            resetBeam();
-                laser_rotation = 2.0 * 45 - laser_rotation;
-               // cout << laser_rotation << endl;
-                laser_x = leading_point_x + (0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-                laser_y = leading_point_y + (0.4/ 2.0) * sin((double)laser_rotation*M_PI/180.0f);
+/* Cut path short at the first block it runs into and return that block, or -1 */
+int clipToBlocks (LaserPath &path)
+{
+    for (int k=0; k+1<path.count; k++)
+    {
+        Scalar x0 = path.x[k], y0 = path.y[k];
+        Scalar vx = path.x[k+1] - x0, vy = path.y[k+1] - y0;
+        Scalar first = 2;
+        int hit = -1;
+        for (int i=0; i<block_x.size(); i++) {
+            // Slab test of the segment against the block's box
+            Scalar bx = block_x[i], by = blockY(i);
+            Scalar t0 = 0, t1 = 1;
+            if (vx != 0) {
+                Scalar a = (bx - BLOCK_HIT_HALF_WIDTH - x0)/vx, b = (bx + BLOCK_HIT_HALF_WIDTH - x0)/vx;
+                t0 = max(t0, min(a, b));
+                t1 = min(t1, max(a, b));
+            } else if (fabs(x0 - bx) > BLOCK_HIT_HALF_WIDTH)
+                continue;
+            if (vy != 0) {
+                Scalar a = (by - BLOCK_HIT_HALF_HEIGHT - y0)/vy, b = (by + BLOCK_HIT_HALF_HEIGHT - y0)/vy;
+                t0 = max(t0, min(a, b));
+                t1 = min(t1, max(a, b));
+            } else if (fabs(y0 - by) > BLOCK_HIT_HALF_HEIGHT)
+                continue;
+            if (t0 <= t1 && t0 < first) {
+                first = t0;
+                hit = i;
             }
         }
-        if(laserFlag==1)
-        {
-            double leading_point_x = (double)laser_x + ((double)0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-            double leading_point_y = (double)laser_y + ((double)0.4 / 2.0) * sin((double)laser_rotation*M_PI/180.0f);
+        if (hit >= 0) {
+            path.x[k+1] = x0 + first*vx;
+            path.y[k+1] = y0 + first*vy;
+            path.count = k+2;
+            return hit;
+        }
+    }
+    return -1;
+}
 
+/* The turret's path against the fixed mirrors, retraced only when the
+   turret moves. Moving mirrors change every tick, so each use only tests
+   them against the cached segments and retraces from the first one hit.
+   Blocks fall every tick too and are clipped per use. */
+struct AimCache {
+    bool valid;
+    Scalar dx, dy, turrety;
+    LaserPath static_path, path;
+} aim_cache;
+
+const LaserPath& aimPath ()
+{
+    if (!aim_cache.valid || aim_cache.dx != turret_dx || aim_cache.dy != turret_dy || aim_cache.turrety != turrety) {
+        traceLaser(-4, turrety, turret_dx, turret_dy, aim_cache.static_path, STATIC_MIRRORS);
+        aim_cache.valid = true;
+        aim_cache.dx = turret_dx;
+        aim_cache.dy = turret_dy;
+        aim_cache.turrety = turrety;
+    }
+    LaserPath &path = aim_cache.path;
+    path = aim_cache.static_path;
+    for (int k=0; k+1<path.count; k++)
+    {
+        Scalar vx = path.x[k+1] - path.x[k], vy = path.y[k+1] - path.y[k];
+        Scalar t = sqrt(vx*vx + vy*vy);
+        if (t == 0)
+            continue;
+        Scalar dx = vx/t, dy = vy/t;
+        int hit = nearestMirror(path.x[k], path.y[k], dx, dy, t, -1, MOVING_MIRRORS);
+        if (hit < 0)
+            continue;
+        path.x[k+1] = path.x[k] + t*dx;
+        path.y[k+1] = path.y[k] + t*dy;
+        path.count = k+2;
+        reflect(dx, dy, hit);
+        extendLaser(path, dx, dy, hit, ALL_MIRRORS);
+        break;
+    }
+    return path;
+}
 
-            double mirror_ax = 1.7 + (0.8 / 2.0) * cos(0*M_PI/180.0f);
-            double mirror_ay = 3 + (0.8 / 2.0) * sin(0*M_PI/180.0f);
-            double mirror_bx = 1.7 - (0.8 / 2.0) * cos(0*M_PI/180.0f);
-            double mirror_by = 3 - (0.8 / 2.0) * sin(0*M_PI/180.0f);
+/* The travelling laser is LASER_LENGTH long and moves LASER_STEP a tick.
+   It bounces where its leading point would cross a mirror during the
+   step, found with the same intersection as traceLaser. */
+#define LASER_LENGTH 0.4
+#define LASER_STEP 0.1
 
-            double d1 = sqrt(pow(mirror_ax - leading_point_x, 2) + pow(mirror_ay - leading_point_y, 2));
-            double d2 = sqrt(pow(mirror_bx - leading_point_x, 2) + pow(mirror_by - leading_point_y, 2));
+int laser_last_mirror = -1;     // mirror the travelling laser last bounced off
 
-            if (fabs(d1 + d2-0.8)<=0.02)
-            {
-                //            resetBeam();
-                laser_rotation = 2.0 * 0 - laser_rotation;
-              //  cout << laser_rotation << endl;
-                laser_x = leading_point_x + (0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-                laser_y = leading_point_y + (0.4/ 2.0) * sin((double)laser_rotation*M_PI/180.0f);
-            }
-        }
-        if(laserFlag==1)
-        {
-            double leading_point_x = (double)laser_x + ((double)0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-            double leading_point_y = (double)laser_y + ((double)0.4 / 2.0) * sin((double)laser_rotation*M_PI/180.0f);
+void reflectLaser ()
+{
+    Scalar lead_x = laser_x + (Scalar) (LASER_LENGTH/2)*laser_dx, lead_y = laser_y + (Scalar) (LASER_LENGTH/2)*laser_dy;
+    Scalar t = LASER_STEP;
+    int hit = nearestMirror(lead_x, lead_y, laser_dx, laser_dy, t, laser_last_mirror, ALL_MIRRORS);
+    if (hit < 0)
+        return;
+    // Put the leading point on the mirror, turned to the reflected direction
+    lead_x += t*laser_dx;
+    lead_y += t*laser_dy;
+    reflect(laser_dx, laser_dy, hit);
+    laser_x = lead_x - (Scalar) (LASER_LENGTH/2)*laser_dx;
+    laser_y = lead_y - (Scalar) (LASER_LENGTH/2)*laser_dy;
+    laser_last_mirror = hit;
+}
 
+int beam_ticks = 0;
 
-            double mirror_ax = 2.7 + (0.8 / 2.0) * cos(90*M_PI/180.0f);
-            double mirror_ay = mirror_y + (0.8 / 2.0) * sin(90*M_PI/180.0f);
-            double mirror_bx = 2.7 - (0.8 / 2.0) * cos(90*M_PI/180.0f);
-            double mirror_by = mirror_y - (0.8 / 2.0) * sin(90*M_PI/180.0f);
+void fireLaser ()
+{
+    if (!options.hitscan) {
+        laserFlag=1;
+        laser_x=-4;
+        laser_y=turrety;
+        laser_dx=turret_dx;
+        laser_dy=turret_dy;
+        laser_last_mirror=-1;
+        return;
+    }
+    laser_beam = aimPath();
+    int i = clipToBlocks(laser_beam);
+    if (i >= 0) {
+        removeBlock(i);
+        score+=30;
+    }
+    beam_ticks = BEAM_TICKS;
+}
 
-            double d1 = sqrt(pow(mirror_ax - leading_point_x, 2) + pow(mirror_ay - leading_point_y, 2));
-            double d2 = sqrt(pow(mirror_bx - leading_point_x, 2) + pow(mirror_by - leading_point_y, 2));
+long sim_tick = 0, last_spawn_tick = 0;
+int next_spawn = 0;
 
-            if (fabs(d1 + d2-0.8)<=0.02)
-            {
-                //            resetBeam();
-                laser_rotation = 2.0 * 90 - laser_rotation;
-         //       cout << laser_rotation << endl;
-                laser_x = leading_point_x + (0.4 / 2.0) * cos((double)laser_rotation*M_PI/180.0f);
-                laser_y = leading_point_y + (0.4/ 2.0) * sin((double)laser_rotation*M_PI/180.0f);
-            }
-        }
-        for(i=0;i<block_x.size();i++)
+/* Random spawns use their own xorshift generator rather than rand(), so a
+   run is reproducible from its seed on any C library */
+uint32_t sim_rng = 1;
+
+uint32_t simRandom ()
+{
+    sim_rng ^= sim_rng << 13;
+    sim_rng ^= sim_rng >> 17;
+    sim_rng ^= sim_rng << 5;
+    return sim_rng;
+}
+
+/* Advance the world by one tick */
+void simulate ()
+{
+    if (fire_requested) {
+        fireLaser();
+        fire_requested = false;
+    }
+    if (beam_ticks > 0 && --beam_ticks == 0)
+        laser_beam.count = 0;
+
+    if(laser_x<-5.0 || laser_x>5.0 || laser_y>5.0 || laser_y<-5.0)
+        laserFlag=0;
+    moveMirrors();
+
+    int i;
+    Scalar x_tmp=0,head_x,head_y;
+    for(i=0;i<block_x.size();i++)
+    {
+        x_tmp=0;
+        if(laserFlag==1)
         {
-            block_y[i]-=blockSpeed;
-            int greenFlag=0,redFlag=0;
-            if(block_y[i]<=-3.1 && block_y[i]>=-3.9)
+            while(x_tmp>=-0.2)
             {
-                if(block_color[i]==1)
-                {
-                    if(block_x[i]<=greenx+0.8 && block_x[i]>=greenx-0.8)
-                    {
-                        greenFlag=1;
-                        score+=20;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                    }
-                    if(block_x[i]<=redx+0.8 && block_x[i]>=redx-0.8)
-                    {
-                        if(greenFlag==1)
-                            score-=20;
-                        else
-                            score-=30;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                    }
-                }
-                else if(block_color[i]==0)
+                head_y=laser_y+0.01*laser_dy;
+                head_x=laser_x+0.2*laser_dx+x_tmp;
+                Scalar block_y = blockY(i);
+                if(head_x<=block_x[i]+0.31 && head_x>=block_x[i]-0.31 && head_y<=block_y+0.21 && head_y>=block_y-0.21)
                 {
-                    if(block_x[i]<=redx+0.8 && block_x[i]>=redx-0.8)
-                    {
-                        redFlag=1;
-                        score+=20;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                    }
-                    else if(block_x[i]<=greenx+0.8 && block_x[i]>=greenx-0.8)
-                    {
-                        if(redFlag==1)
-                            score-=20;
-                        else
-                            score=-30;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                    }
-                }
-                else
-                {
-                    if(block_x[i]<=greenx+0.8 && block_x[i]>=greenx-0.8)
-                    {
-                        score-=50;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                        numberOfBlack+=1;
-                    }
-                    else if(block_x[i]<=redx+0.8 && block_x[i]>=redx-0.8)
-                    {
-                        score-=50;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                        numberOfBlack+=1;
-                    }
-                    else
-                    {
-                        score-=10;
-                        block_x.erase(block_x.begin()+i);
-                        block_color.erase(block_color.begin()+i);
-                        block_y.erase(block_y.begin()+i);
-                        //numberOfBlack+=1;
-                    }
+                    removeBlock(i);
+                    score+=30;
+                    laserFlag=0;
+                    break;
                 }
+                x_tmp-=0.02;
             }
         }
+    }
+    if(laserFlag==1)
+        reflectLaser();
+    moveBlocks();
 
+    // Spawn scheduled and random blocks
+    while(next_spawn<level.header->num_spawns && sim_tick>=level.spawns[next_spawn].time*SIM_HZ)
+    {
+        spawnBlock(level.spawns[next_spawn].x, level.header->spawn_y, level.spawns[next_spawn].color);
+        next_spawn++;
+    }
+    if (level.header->spawn_interval > 0 && sim_tick-last_spawn_tick >= level.header->spawn_interval*SIM_HZ)
+    { // atleast spawn_interval elapsed since the last random block
+        Scalar spread = (Scalar) level.header->spawn_max_x - level.header->spawn_min_x;
+        Scalar fraction = (simRandom() >> 8) / (float) (1 << 24);     // exact in a float
+        spawnBlock(level.header->spawn_min_x + spread*fraction, level.header->spawn_y, simRandom()%3);
+        last_spawn_tick = sim_tick;
+    }
+    if(laserFlag==1)
+    {
+        laser_x+=LASER_STEP*laser_dx;
+        laser_y+=LASER_STEP*laser_dy;
+    }
+    if (options.aim_preview) {
+        aim_preview = aimPath();
+        clipToBlocks(aim_preview);
+    }
+    sim_tick++;
+}
 
-        //cout << score << endl;
-        // OpenGL Draw commands
-        draw();
-        //draw_block();
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
+/**************************
+ * World hashing          *
+ **************************/
 
-        // Poll for Keyboard and mouse events
-        glfwPollEvents();
+/* Word-at-a-time hash in the style of xxHash: each 64-bit word goes
+   through a multiply-rotate round, the result through a final avalanche.
+   A few hundred words per tick cost well under a microsecond. */
+#define HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME_3 0x165667B19E3779F9ULL
+#define HASH_PRIME_4 0x85EBCA77C2B2AE63ULL
 
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        if ((current_time - last_update_time) >= 3.0)
-        { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            block_x.push_back(float((float)(rand()%550-350)/(float)100));
-            block_y.push_back(4.5);
-            block_color.push_back(rand()%3);
-            //    draw_flag = 1;
-            last_update_time = current_time;
-            //number_of_blocks++;
-        }
-        if(score< -20)
-            break;
-        if(laserFlag==1)
-        {   //printf("%f\n", laser_rotation);
-            laser_x+=cos(laser_rotation*M_PI/180)/10;
-            laser_y+=sin(laser_rotation*M_PI/180)/10;
-        }
-        // cout << laser_rotation*M_PI << endl;
-        // cout << laser_x << " " << laser_y << endl;
-        //else
-        //{
-        //  draw_flag = 0;
-        //}
+inline uint64_t rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t hashWords (const void *data, size_t length, uint64_t seed=0)
+{
+    const unsigned char *bytes = (const unsigned char*) data;
+    uint64_t acc = seed + HASH_PRIME_3 + length;
+    for (size_t i=0; i<length; i+=8) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, min((size_t) 8, length - i));
+        acc ^= rotl64(word * HASH_PRIME_2, 31) * HASH_PRIME_1;
+        acc = rotl64(acc, 27) * HASH_PRIME_1 + HASH_PRIME_4;
     }
-    if(score > 100)
-        cout << "YOU WON" << endl;
-    if(score < 100)
-        cout << "YOU LOST" << endl;
-    cout << score << endl;
-    free(buffer);
-    ao_close(dev);
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
-    ao_shutdown();
+    acc ^= acc >> 33;
+    acc *= HASH_PRIME_2;
+    acc ^= acc >> 29;
+    acc *= HASH_PRIME_3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+/* The world is hashed field by field, so a mismatch can say what diverged */
+enum HashField { HASH_BLOCKS, HASH_LASER, HASH_TURRET, HASH_BASKETS, HASH_MIRRORS, HASH_SCORE, HASH_SPAWNER, NUM_HASH_FIELDS };
+
+const char *HASH_FIELD_NAMES[NUM_HASH_FIELDS] = { "blocks", "laser", "turret", "baskets", "mirrors", "score", "spawner" };
+
+void hashWorld (uint64_t fields[NUM_HASH_FIELDS])
+{
+    uint64_t h = hashWords(&fall_distance, sizeof(fall_distance));
+    h = hashWords(block_x.data(), block_x.size()*sizeof(Scalar), h);
+    h = hashWords(block_base_y.data(), block_base_y.size()*sizeof(Scalar), h);
+    fields[HASH_BLOCKS] = hashWords(block_color.data(), block_color.size()*sizeof(int), h);
+
+    Scalar laser[] = { laser_x, laser_y, laser_dx, laser_dy };
+    fields[HASH_LASER] = hashWords(laser, sizeof(laser), laserFlag);
+
+    Scalar turret[] = { turrety, turret_dx, turret_dy };
+    fields[HASH_TURRET] = hashWords(turret, sizeof(turret));
+
+    Scalar baskets[] = { redx, greenx };
+    fields[HASH_BASKETS] = hashWords(baskets, sizeof(baskets));
+
+    h = hashWords(mirror_x.data(), mirror_x.size()*sizeof(Scalar));
+    fields[HASH_MIRRORS] = hashWords(mirror_y.data(), mirror_y.size()*sizeof(Scalar), h);
+
+    int32_t scores[] = { score, numberOfBlack };
+    fields[HASH_SCORE] = hashWords(scores, sizeof(scores));
+
+    int64_t spawner[] = { sim_rng, next_spawn, last_spawn_tick, next_block_serial };
+    fields[HASH_SPAWNER] = hashWords(spawner, sizeof(spawner));
+}
+
+uint64_t worldHash ()
+{
+    uint64_t fields[NUM_HASH_FIELDS];
+    hashWorld(fields);
+    return hashWords(fields, sizeof(fields));
+}
+
+/* --sim-check: play the level headless with scripted input and print a hash
+   of the final world. FIXED_POINT_SIM builds print the same line whatever
+   the compiler, flags or CPU, see "make determinism-check". */
+int runSimCheck (long ticks)
+{
+    reserveBlocks(maxLiveBlocks(*level.header));
+    sim_rng = 1;
+    int basket_step = 1;
+    for (long tick = 0; tick < ticks; tick++)
+    {
+        // Sweep the baskets across the floor, swing the turret and fire twice a second
+        redx += basket_step*(Scalar) 0.1;
+        greenx -= basket_step*(Scalar) 0.1;
+        if (redx >= 2.5 || redx <= -2.5)
+            basket_step = -basket_step;
+        rotateTurret(TURRET_STEP, (tick/SIM_HZ) % 2 ? -1 : 1);
+        if (tick % (SIM_HZ/2) == 0)
+            fire_requested = true;
+        simulate();
+#ifdef COUNT_ALLOCATIONS
+        checkAllocations("tick", tick);
+#endif
+    }
+    printf("tick %ld score %d blocks %d hash %016llx\n", sim_tick, score, (int) block_x.size(), (unsigned long long) worldHash());
+    return 0;
+}
+
+/**************************
+ * Replays                *
+ **************************/
+
+/* A replay is the seed plus everything input changed, tick by tick, so
+   playing it back runs the same game. It is a ReplayHeader followed by
+   chunks. An input chunk is written whenever the controls differ from the
+   last ones written; with --record-hashes every tick also gets a hash
+   chunk, which playback compares against its own world. */
+#define REPLAY_MAGIC 0x50524242   // "BBRP"
+#define REPLAY_VERSION 2         // 2 added the laser direction to the controls
+
+enum ReplayFlags { REPLAY_HITSCAN = 1, REPLAY_FIXED_POINT = 2 };
+
+struct ReplayHeader {
+    uint32_t magic, version;
+    uint32_t flags;
+    uint32_t seed;                  // sim_rng at tick 0
+    uint64_t level_hash;            // of the level binary
+    char level_path[256];
+};
+
+enum ReplayChunkType { CHUNK_INPUT = 1, CHUNK_HASH = 2, CHUNK_END = 3, CHUNK_SNAPSHOT = 4, CHUNK_INDEX = 5 };
+
+struct ReplayChunk {
+    uint32_t type;
+    uint32_t size;                  // of the payload that follows
+    int64_t tick;
+};
+
+/* What the input callbacks may change between ticks */
+struct ReplayControls {
+    Scalar redx, greenx, turrety, turret_dx, turret_dy, blockSpeed;
+    Scalar laser_dx, laser_dy;      // aimed by the cursor while no laser is in flight
+    int32_t fire;
+};
+
+struct Replay {
+    FILE *file;
+    bool recording, playing, hashes;
+    ReplayControls controls;        // last written, or being played back
+    bool have_controls;
+
+    // Playback reads one chunk ahead
+    ReplayChunk next;
+    unsigned char payload[256];
+    bool diverged;
+} replay;
+
+ReplayControls currentControls ()
+{
+    ReplayControls c;
+    c.redx = redx;
+    c.greenx = greenx;
+    c.turrety = turrety;
+    c.turret_dx = turret_dx;
+    c.turret_dy = turret_dy;
+    c.blockSpeed = blockSpeed;
+    c.laser_dx = laser_dx;
+    c.laser_dy = laser_dy;
+    c.fire = fire_requested;
+    return c;
+}
+
+void applyControls (const ReplayControls &c)
+{
+    redx = c.redx;
+    greenx = c.greenx;
+    turrety = c.turrety;
+    turret_dx = c.turret_dx;
+    turret_dy = c.turret_dy;
+    blockSpeed = c.blockSpeed;
+    laser_dx = c.laser_dx;
+    laser_dy = c.laser_dy;
+    fire_requested = c.fire != 0;
+}
+
+uint32_t replayFlags ()
+{
+    uint32_t flags = options.hitscan ? REPLAY_HITSCAN : 0;
+#ifdef FIXED_POINT_SIM
+    flags |= REPLAY_FIXED_POINT;
+#endif
+    return flags;
+}
+
+void writeChunk (uint32_t type, long tick, const void *payload, uint32_t size)
+{
+    ReplayChunk chunk = { type, size, tick };
+    fwrite(&chunk, sizeof(chunk), 1, replay.file);
+    if (size)
+        fwrite(payload, size, 1, replay.file);
+}
+
+/* Every REPLAY_SNAPSHOT_TICKS the whole simulation state goes into the
+   replay too, and the file ends with an index of those snapshots, so
+   playback can start at any tick by restoring the snapshot before it and
+   simulating less than REPLAY_SNAPSHOT_TICKS ticks forward. */
+#define REPLAY_SNAPSHOT_TICKS (SIM_HZ*10)
+#define REPLAY_INDEX_MAGIC 0x58494242   // "BBIX"
+#define REPLAY_INDEX_RESERVE 1440       // four hours of snapshots before the index grows
+
+struct ReplayIndexEntry {
+    int64_t tick;
+    int64_t snapshot_offset;        // of its CHUNK_SNAPSHOT
+    int64_t stream_offset;          // of the first chunk of that tick
+};
+
+/* The last bytes of an indexed replay */
+struct ReplayTrailer {
+    int64_t index_offset;           // of the CHUNK_INDEX
+    uint32_t magic;
+    uint32_t count;
+};
+
+/* Everything simulate() reads or writes, at the start of a tick: the scalars here, the lists in SimState */
+struct SimValues {
+    int64_t sim_tick, last_spawn_tick, next_block_serial;
+    int32_t next_spawn, score, numberOfBlack, laserFlag, laser_last_mirror, beam_ticks, fire_requested, have_controls;
+    uint32_t sim_rng;
+    Scalar redx, greenx, prev_redx, prev_greenx, turrety, turret_dx, turret_dy;
+    Scalar laser_x, laser_y, laser_dx, laser_dy, blockSpeed, fall_distance;
+    LaserPath laser_beam;
+    ReplayControls controls;    // in effect for playback
+};
+
+struct SimState {
+    SimValues values;
+    vector <Scalar> block_x, block_base_y, mirror_x, mirror_y, mirror_phase;
+    vector <int> block_color;
+    vector <long> block_serial, band_blocks;
+    vector <BlockEvent> block_events;
+};
+
+void captureValues (SimValues &values)
+{
+    values.sim_tick = sim_tick;
+    values.last_spawn_tick = last_spawn_tick;
+    values.next_block_serial = next_block_serial;
+    values.next_spawn = next_spawn;
+    values.score = score;
+    values.numberOfBlack = numberOfBlack;
+    values.laserFlag = laserFlag;
+    values.laser_last_mirror = laser_last_mirror;
+    values.beam_ticks = beam_ticks;
+    values.fire_requested = fire_requested;
+    values.have_controls = replay.have_controls;
+    values.sim_rng = sim_rng;
+    values.redx = redx;
+    values.greenx = greenx;
+    values.prev_redx = prev_redx;
+    values.prev_greenx = prev_greenx;
+    values.turrety = turrety;
+    values.turret_dx = turret_dx;
+    values.turret_dy = turret_dy;
+    values.laser_x = laser_x;
+    values.laser_y = laser_y;
+    values.laser_dx = laser_dx;
+    values.laser_dy = laser_dy;
+    values.blockSpeed = blockSpeed;
+    values.fall_distance = fall_distance;
+    values.laser_beam = laser_beam;
+    values.controls = replay.controls;
+}
+
+void captureState (SimState &state)
+{
+    captureValues(state.values);
+    // assign() reuses capacity, so a warm copy does not allocate
+    state.block_x.assign(block_x.begin(), block_x.end());
+    state.block_base_y.assign(block_base_y.begin(), block_base_y.end());
+    state.mirror_x.assign(mirror_x.begin(), mirror_x.end());
+    state.mirror_y.assign(mirror_y.begin(), mirror_y.end());
+    state.mirror_phase.assign(mirror_phase.begin(), mirror_phase.end());
+    state.block_color.assign(block_color.begin(), block_color.end());
+    state.block_serial.assign(block_serial.begin(), block_serial.end());
+    state.band_blocks.assign(band_blocks.begin(), band_blocks.end());
+    state.block_events.assign(block_events.begin(), block_events.end());
+}
+
+void restoreState (const SimState &state)
+{
+    sim_tick = state.values.sim_tick;
+    last_spawn_tick = state.values.last_spawn_tick;
+    next_block_serial = state.values.next_block_serial;
+    next_spawn = state.values.next_spawn;
+    score = state.values.score;
+    numberOfBlack = state.values.numberOfBlack;
+    laserFlag = state.values.laserFlag;
+    laser_last_mirror = state.values.laser_last_mirror;
+    beam_ticks = state.values.beam_ticks;
+    fire_requested = state.values.fire_requested;
+    replay.have_controls = state.values.have_controls;
+    sim_rng = state.values.sim_rng;
+    redx = state.values.redx;
+    greenx = state.values.greenx;
+    prev_redx = state.values.prev_redx;
+    prev_greenx = state.values.prev_greenx;
+    turrety = state.values.turrety;
+    turret_dx = state.values.turret_dx;
+    turret_dy = state.values.turret_dy;
+    laser_x = state.values.laser_x;
+    laser_y = state.values.laser_y;
+    laser_dx = state.values.laser_dx;
+    laser_dy = state.values.laser_dy;
+    blockSpeed = state.values.blockSpeed;
+    fall_distance = state.values.fall_distance;
+    laser_beam = state.values.laser_beam;
+    replay.controls = state.values.controls;
+    block_x = state.block_x;
+    block_base_y = state.block_base_y;
+    mirror_x = state.mirror_x;
+    mirror_y = state.mirror_y;
+    mirror_phase = state.mirror_phase;
+    block_color = state.block_color;
+    block_serial = state.block_serial;
+    band_blocks = state.band_blocks;
+    block_events = state.block_events;
+    block_generation++;             // the renderer must upload the restored blocks
+    aim_cache.valid = false;
+}
+
+template <typename T> void putVector (vector <unsigned char> &bytes, const vector <T> &v)
+{
+    uint32_t count = v.size();
+    const unsigned char *data = (const unsigned char*) v.data();
+    bytes.insert(bytes.end(), (const unsigned char*) &count, (const unsigned char*) (&count + 1));
+    bytes.insert(bytes.end(), data, data + count*sizeof(T));
+}
+
+template <typename T> bool getVector (const vector <unsigned char> &bytes, size_t &pos, vector <T> &v)
+{
+    uint32_t count;
+    if (pos + sizeof(count) > bytes.size())
+        return false;
+    memcpy(&count, &bytes[pos], sizeof(count));
+    pos += sizeof(count);
+    if (pos + (size_t) count*sizeof(T) > bytes.size())
+        return false;
+    v.resize(count);
+    memcpy(v.data(), &bytes[pos], count*sizeof(T));
+    pos += count*sizeof(T);
+    return true;
+}
+
+void serializeState (const SimState &state, vector <unsigned char> &bytes)
+{
+    const unsigned char *values = (const unsigned char*) &state.values;
+    bytes.assign(values, values + sizeof(state.values));
+    putVector(bytes, state.block_x);
+    putVector(bytes, state.block_base_y);
+    putVector(bytes, state.mirror_x);
+    putVector(bytes, state.mirror_y);
+    putVector(bytes, state.mirror_phase);
+    putVector(bytes, state.block_color);
+    putVector(bytes, state.block_serial);
+    putVector(bytes, state.band_blocks);
+    putVector(bytes, state.block_events);
+}
+
+bool deserializeState (const vector <unsigned char> &bytes, SimState &state)
+{
+    if (bytes.size() < sizeof(state.values))
+        return false;
+    memcpy(&state.values, bytes.data(), sizeof(state.values));
+    size_t pos = sizeof(state.values);
+    return getVector(bytes, pos, state.block_x) && getVector(bytes, pos, state.block_base_y) &&
+           getVector(bytes, pos, state.mirror_x) && getVector(bytes, pos, state.mirror_y) &&
+           getVector(bytes, pos, state.mirror_phase) && getVector(bytes, pos, state.block_color) &&
+           getVector(bytes, pos, state.block_serial) && getVector(bytes, pos, state.band_blocks) &&
+           getVector(bytes, pos, state.block_events);
+}
+
+/* Snapshots are copied on the main thread, serialized on this thread and
+   handed back as bytes for the main thread to append, so a tick never
+   waits on serialization or on the other thread. One is in flight at most;
+   if the last one is still busy when the next is due, that one is skipped. */
+struct SnapshotWriter {
+    thread worker;
+    mutex lock;
+    condition_variable wake;
+    bool stop;
+    atomic<bool> pending;           // state holds a copy to serialize
+    atomic<bool> ready;             // bytes hold a serialized snapshot to append
+    SimState state;
+    int64_t stream_offset;
+    vector <unsigned char> bytes;
+    vector <ReplayIndexEntry> index;
+} snapshot_writer;
+
+void snapshotWriterLoop ()
+{
+    SnapshotWriter &w = snapshot_writer;
+    while (true) {
+        {
+            unique_lock<mutex> lock(w.lock);
+            w.wake.wait(lock, [&w] { return w.pending || w.stop; });
+            if (!w.pending)
+                return;
+        }
+        serializeState(w.state, w.bytes);
+        w.pending = false;
+        w.ready = true;
+    }
+}
+
+/* Main thread, at the start of a recorded tick */
+void recordSnapshots ()
+{
+    SnapshotWriter &w = snapshot_writer;
+    if (w.ready) {
+        ReplayIndexEntry entry = { w.state.values.sim_tick, ftell(replay.file), w.stream_offset };
+        writeChunk(CHUNK_SNAPSHOT, entry.tick, w.bytes.data(), w.bytes.size());
+        w.index.push_back(entry);
+        w.ready = false;
+    }
+    if (sim_tick % REPLAY_SNAPSHOT_TICKS == 0 && !w.pending && !w.ready) {
+        captureState(w.state);
+        w.stream_offset = ftell(replay.file);
+        {
+            lock_guard<mutex> lock(w.lock);
+            w.pending = true;
+        }
+        w.wake.notify_one();
+    }
+}
+
+void startSnapshotWriter ()
+{
+    SnapshotWriter &w = snapshot_writer;
+    w.stop = false;
+    w.pending = false;
+    w.ready = false;
+    w.index.clear();
+
+    // Sized for the level now, so recordSnapshots does not allocate in a tick
+    size_t max_blocks = maxLiveBlocks(*level.header);
+    w.index.reserve(REPLAY_INDEX_RESERVE);
+    w.state.block_x.reserve(max_blocks);
+    w.state.block_base_y.reserve(max_blocks);
+    w.state.block_color.reserve(max_blocks);
+    w.state.block_serial.reserve(max_blocks);
+    w.state.band_blocks.reserve(max_blocks);
+    w.state.block_events.reserve(max_blocks);
+    w.state.mirror_x.reserve(mirror_x.size());
+    w.state.mirror_y.reserve(mirror_y.size());
+    w.state.mirror_phase.reserve(mirror_phase.size());
+    w.worker = thread(snapshotWriterLoop);
+}
+
+/* Finish the snapshot in flight, then write the index and trailer after the end chunk */
+void finishSnapshots ()
+{
+    SnapshotWriter &w = snapshot_writer;
+    {
+        lock_guard<mutex> lock(w.lock);
+        w.stop = true;
+    }
+    w.wake.notify_one();
+    w.worker.join();
+    recordSnapshots();
+    writeChunk(CHUNK_END, sim_tick, NULL, 0);
+
+    ReplayTrailer trailer = { ftell(replay.file), REPLAY_INDEX_MAGIC, (uint32_t) w.index.size() };
+    writeChunk(CHUNK_INDEX, 0, w.index.data(), w.index.size()*sizeof(ReplayIndexEntry));
+    fwrite(&trailer, sizeof(trailer), 1, replay.file);
+}
+
+bool startRecording (const char *path, bool hashes)
+{
+    replay.file = fopen(path, "wb");
+    if (!replay.file) {
+        fprintf(stderr, "Cannot write replay %s\n", path);
+        return false;
+    }
+    ReplayHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = REPLAY_MAGIC;
+    header.version = REPLAY_VERSION;
+    header.flags = replayFlags();
+    header.seed = sim_rng;
+    header.level_hash = hashWords(level.map, level.map_size);
+    strncpy(header.level_path, options.level_path, sizeof(header.level_path) - 1);
+    fwrite(&header, sizeof(header), 1, replay.file);
+    replay.recording = true;
+    replay.hashes = hashes;
+    replay.have_controls = false;
+    startSnapshotWriter();
+    return true;
+}
+
+bool readChunk ()
+{
+    bool whole = fread(&replay.next, sizeof(replay.next), 1, replay.file) == 1;
+    if (whole && replay.next.size > sizeof(replay.payload))
+        return fseek(replay.file, replay.next.size, SEEK_CUR) == 0;   // not ours, skip it
+    if (whole && replay.next.size > 0)
+        whole = fread(replay.payload, replay.next.size, 1, replay.file) == 1;
+    if (!whole) {
+        // Cut short, e.g. the game crashed while recording: end here
+        replay.next.type = CHUNK_END;
+        replay.next.tick = 0;
+    }
+    return whole;
+}
+
+/* Opens a replay and points options.level_path at its level, call before loadLevel */
+bool openReplay (const char *path, ReplayHeader &header)
+{
+    replay.file = fopen(path, "rb");
+    if (!replay.file || fread(&header, sizeof(header), 1, replay.file) != 1 ||
+        header.magic != REPLAY_MAGIC || header.version != REPLAY_VERSION) {
+        fprintf(stderr, "%s is not a replay\n", path);
+        return false;
+    }
+    if ((header.flags & REPLAY_FIXED_POINT) != (replayFlags() & REPLAY_FIXED_POINT)) {
+        fprintf(stderr, "%s was recorded by a %s build\n", path, header.flags & REPLAY_FIXED_POINT ? "fixed point" : "floating point");
+        return false;
+    }
+    header.level_path[sizeof(header.level_path) - 1] = 0;
+    options.level_path = header.level_path;
+    options.hitscan = header.flags & REPLAY_HITSCAN;
+    return true;
+}
+
+/* Call after loadLevel */
+bool startPlayback (const ReplayHeader &header)
+{
+    if (hashWords(level.map, level.map_size) != header.level_hash) {
+        fprintf(stderr, "%s has changed since the replay was recorded\n", header.level_path);
+        return false;
+    }
+    sim_rng = header.seed;
+    replay.playing = true;
+    replay.have_controls = false;
+    replay.diverged = false;
+    readChunk();
+    return true;
+}
+
+/* Before simulate(): record the controls, or replace them with the recorded
+   ones. Returns false once a replay being played back has ended. */
+bool replayBeforeTick ()
+{
+    if (replay.recording) {
+        recordSnapshots();
+        ReplayControls controls = currentControls();
+        if (!replay.have_controls || memcmp(&controls, &replay.controls, sizeof(controls)) != 0) {
+            writeChunk(CHUNK_INPUT, sim_tick, &controls, sizeof(controls));
+            replay.controls = controls;
+            replay.have_controls = true;
+        }
+    }
+    if (replay.playing) {
+        while (replay.next.type != CHUNK_END && replay.next.tick <= sim_tick) {
+            if (replay.next.type == CHUNK_INPUT && replay.next.size == sizeof(ReplayControls)) {
+                memcpy(&replay.controls, replay.payload, sizeof(ReplayControls));
+                replay.have_controls = true;
+            }
+            else if (replay.next.type == CHUNK_HASH && replay.next.tick == sim_tick)
+                break;  // compared after this tick
+            readChunk();
+        }
+        if (replay.next.type == CHUNK_END && replay.next.tick <= sim_tick)
+            return false;
+        if (replay.have_controls)
+            applyControls(replay.controls);
+    }
+    return true;
+}
+
+/* After simulate(): record or check the world hash of the tick just run */
+void replayAfterTick ()
+{
+    long tick = sim_tick - 1;
+    uint64_t fields[NUM_HASH_FIELDS];
+    if (replay.recording && replay.hashes) {
+        hashWorld(fields);
+        writeChunk(CHUNK_HASH, tick, fields, sizeof(fields));
+    }
+    if (replay.playing && replay.next.type == CHUNK_HASH && replay.next.tick == tick) {
+        if (!replay.diverged && replay.next.size == sizeof(fields)) {
+            hashWorld(fields);
+            const uint64_t *recorded = (const uint64_t*) replay.payload;
+            for (int i=0; i<NUM_HASH_FIELDS; i++)
+                if (fields[i] != recorded[i]) {
+                    printf("Replay diverged at tick %ld in %s\n", tick, HASH_FIELD_NAMES[i]);
+                    replay.diverged = true;
+                    break;
+                }
+        }
+        readChunk();
+    }
+}
+
+void stopReplay ()
+{
+    if (!replay.file)
+        return;
+    if (replay.recording)
+        finishSnapshots();
+    fclose(replay.file);
+    replay.file = NULL;
+    replay.recording = replay.playing = false;
+}
+
+/* Jump a replay being played back to tick: restore the last snapshot
+   before it from the index, then simulate the rest of the way */
+void seekReplay (long tick)
+{
+    ReplayTrailer trailer;
+    long resume = ftell(replay.file);
+    vector <ReplayIndexEntry> index;
+    if (fseek(replay.file, -(long) sizeof(trailer), SEEK_END) == 0 &&
+        fread(&trailer, sizeof(trailer), 1, replay.file) == 1 && trailer.magic == REPLAY_INDEX_MAGIC &&
+        fseek(replay.file, trailer.index_offset + sizeof(ReplayChunk), SEEK_SET) == 0) {
+        index.resize(trailer.count);
+        if (fread(index.data(), sizeof(ReplayIndexEntry), index.size(), replay.file) != index.size())
+            index.clear();
+    }
+    else
+        printf("Replay has no index, simulating from the start\n");
+
+    // Last snapshot at or before tick
+    int i = index.size() - 1;
+    while (i >= 0 && index[i].tick > tick)
+        i--;
+    ReplayChunk chunk;
+    vector <unsigned char> bytes;
+    SimState state;
+    if (i >= 0 && index[i].tick > sim_tick &&
+        fseek(replay.file, index[i].snapshot_offset, SEEK_SET) == 0 &&
+        fread(&chunk, sizeof(chunk), 1, replay.file) == 1 && chunk.type == CHUNK_SNAPSHOT &&
+        (bytes.resize(chunk.size), fread(bytes.data(), 1, chunk.size, replay.file) == chunk.size) &&
+        deserializeState(bytes, state)) {
+        restoreState(state);
+        fseek(replay.file, index[i].stream_offset, SEEK_SET);
+        readChunk();
+    }
+    else
+        fseek(replay.file, resume, SEEK_SET);
+
+    while (sim_tick < tick && replayBeforeTick()) {
+        simulate();
+        replayAfterTick();
+    }
+}
+
+/* --verify-replay: play a replay headless as fast as possible */
+int runReplayCheck ()
+{
+    while (replayBeforeTick()) {
+        simulate();
+        replayAfterTick();
+    }
+    printf("tick %ld score %d hash %016llx%s\n", sim_tick, score, (unsigned long long) worldHash(),
+           replay.diverged ? "" : ", no divergence");
+    return replay.diverged ? 1 : 0;
+}
+
+/**************************
+ * Self test              *
+ **************************/
+
+/* --self-test drives the simulation headless and checks what it does, as
+   opposed to the static_asserts above, which only check the table. It
+   prints each failure and exits 1 if there were any. */
+int self_test_failures = 0;
+
+void expect (bool ok, const char *what)
+{
+    if (ok)
+        return;
+    printf("self-test: %s\n", what);
+    self_test_failures++;
+}
+
+/* An empty playfield with the baskets parked at red_x and green_x */
+void clearBlocks (float red_x, float green_x)
+{
+    block_x.clear();
+    block_base_y.clear();
+    block_color.clear();
+    block_serial.clear();
+    block_events.clear();
+    band_blocks.clear();
+    block_generation++;
+    fall_distance = 0;
+    score = numberOfBlack = 0;
+    redx = prev_redx = red_x;
+    greenx = prev_greenx = green_x;
+}
+
+/* Drop a block of every kind onto every combination of baskets and check
+   the score, the black count and when the block leaves play */
+void testScoring ()
+{
+    static const char *kinds[] = { "red", "green", "black" };
+    static const char *hits[] = { "no basket", "the red basket", "the green basket", "both baskets" };
+    // Basket positions for each BasketHit, with the block falling at x = 0
+    static const float red_at[] = { 3, 0, 3, 0 }, green_at[] = { -3, -3, 0, 0 };
+    blockSpeed = 0.05;
+    for (int kind=0; kind<NUM_BLOCK_KINDS; kind++)
+        for (int hit=0; hit<NUM_BASKET_HITS; hit++) {
+            const ScoreOutcome &rule = SCORE_TABLE[kind][hit];
+            char what[128];
+            clearBlocks(red_at[hit], green_at[hit]);
+            spawnBlock(0, BASKET_BAND_TOP + 0.2, kind);
+            long serial = block_serial[0];
+
+            // Fall until just below the band: consumed blocks are gone, the rest still fall
+            int i;
+            while ((i = findBlock(serial)) >= 0 && blockY(i) > BASKET_BAND_BOTTOM - 0.1)
+                moveBlocks();
+            snprintf(what, sizeof(what), "%s block over %s scored %d, not %d", kinds[kind], hits[hit], score, rule.score);
+            expect(score == rule.score, what);
+            snprintf(what, sizeof(what), "%s block over %s counted %d black, not %d", kinds[kind], hits[hit], numberOfBlack, rule.black);
+            expect(numberOfBlack == rule.black, what);
+            snprintf(what, sizeof(what), "%s block over %s %s removed in the band", kinds[kind], hits[hit], rule.consumed ? "was not" : "was");
+            expect((findBlock(serial) < 0) == (rule.consumed != 0), what);
+
+            // Whatever is left falls off the screen without scoring again
+            int banked = score, banked_black = numberOfBlack;
+            for (int tick=0; tick<100 && findBlock(serial) >= 0; tick++)
+                moveBlocks();
+            snprintf(what, sizeof(what), "%s block over %s did not leave the screen", kinds[kind], hits[hit]);
+            expect(findBlock(serial) < 0, what);
+            snprintf(what, sizeof(what), "%s block over %s scored again below the band", kinds[kind], hits[hit]);
+            expect(score == banked && numberOfBlack == banked_black, what);
+        }
+
+    // A basket that slides under a block between two ticks still catches it
+    clearBlocks(-3, -3);
+    redx = 3;
+    expect(sweptBasketHit(0, 0, 1) == HIT_RED, "red basket swept under a block missed it");
+    // Both baskets pass under it: the one that gets there first has it
+    greenx = 1;
+    prev_greenx = 0.5;
+    expect(sweptBasketHit(0, 0, 1) == HIT_GREEN, "block went to the later of two baskets");
+
+    // A block that crosses the whole band in one tick is still caught
+    clearBlocks(0, -3);
+    blockSpeed = 1;
+    spawnBlock(0, BASKET_BAND_TOP + 0.1, RED_BLOCK);
+    moveBlocks();
+    expect(score == SCORE_TABLE[RED_BLOCK][HIT_RED].score && block_x.empty(), "block that jumped the band was not caught");
+    clearBlocks(3, -3);
+}
+
+/* One mirror at the origin tilted 45 degrees, so a laser along +x turns to +y */
+void placeTestMirror (LevelMirror &mirror, float path_speed)
+{
+    mirror = LevelMirror();
+    mirror.angle = 45;
+    mirror.path_ay = -1;
+    mirror.path_by = 1;
+    mirror.path_speed = path_speed;
+    level.mirrors = &mirror;
+    mirror_x.assign(1, 0);
+    mirror_y.assign(1, 0);
+    mirror_cos.resize(1);
+    mirror_sin.resize(1);
+    sinCosDegrees(mirror.angle, mirror_sin[0], mirror_cos[0]);
+}
+
+/* The travelling laser and the aim preview must bounce at the same place,
+   and the preview must follow a moving mirror */
+void testLaser ()
+{
+    LevelMirror mirror;
+    placeTestMirror(mirror, 0);
+    LaserPath path;
+    traceLaser(-4, 0, 1, 0, path, ALL_MIRRORS);
+    expect(path.count == 3 && fabs(path.x[1]) < 1e-4 && fabs(path.y[1]) < 1e-4 && fabs(path.y[2] - LASER_BOUNDS) < 1e-4,
+           "traced laser did not turn up at the mirror");
+
+    laserFlag = 1;
+    laser_x = -4;
+    laser_y = 0;
+    laser_dx = 1;
+    laser_dy = 0;
+    laser_last_mirror = -1;
+    for (int tick=0; tick<100 && laser_dx == 1; tick++) {
+        reflectLaser();
+        laser_x += LASER_STEP*laser_dx;
+        laser_y += LASER_STEP*laser_dy;
+    }
+    Scalar lead_x = laser_x + (Scalar) (LASER_LENGTH/2)*laser_dx;
+    expect(fabs(laser_dx) < 1e-3 && fabs(laser_dy - 1) < 1e-3 && fabs(lead_x - path.x[1]) < 1e-3,
+           "travelling laser did not bounce where the traced laser does");
+    laserFlag = 0;
+
+    placeTestMirror(mirror, 0.01);
+    turrety = 0;
+    turret_dx = 1;
+    turret_dy = 0;
+    const LaserPath &aim = aimPath();
+    expect(aim.count == 3 && fabs(aim.y[2] - LASER_BOUNDS) < 1e-4, "aim preview went through a moving mirror");
+    mirror_y[0] = 1;
+    expect(aimPath().count == 2, "aim preview bounced off where a moving mirror used to be");
+
+    mirror_x.clear();
+    mirror_y.clear();
+    mirror_cos.clear();
+    mirror_sin.clear();
+    level = Level();
+    aim_cache.valid = false;
+}
+
+/* A mirrorless level that drops a random block every second, started from
+   the same state each time it is called */
+void startTestGame (LevelHeader &header)
+{
+    header = LevelHeader();
+    header.spawn_interval = 1;
+    header.spawn_y = 4.5;
+    header.spawn_min_x = -3;
+    header.spawn_max_x = 3;
+    header.block_speed = header.min_block_speed = header.max_block_speed = 0.02;
+    level = Level();
+    level.header = &header;
+    clearBlocks(3, -3);
+    reserveBlocks(maxLiveBlocks(header));
+    sim_rng = 1;
+    sim_tick = last_spawn_tick = 0;
+    next_spawn = 0;
+    next_block_serial = 0;
+    blockSpeed = header.block_speed;
+    laserFlag = 0;
+    laser_x = laser_y = 0;
+    laser_last_mirror = -1;
+    beam_ticks = 0;
+    laser_beam.count = 0;
+    turrety = 0;
+    turret_dx = laser_dx = 1;
+    turret_dy = laser_dy = 0;
+}
+
+/* Play back the replay at path from the start, or from tick seek via its
+   snapshot index, to its end. False if it would not open. */
+bool playTestReplay (const char *path, LevelHeader &header, long seek)
+{
+    ReplayHeader replay_header;
+    startTestGame(header);
+    bool opened = openReplay(path, replay_header) && startPlayback(replay_header);
+    if (opened) {
+        if (seek > 0) {
+            seekReplay(seek);
+            expect(sim_tick == seek, "seeking the replay stopped at the wrong tick");
+        }
+        while (replayBeforeTick()) {
+            simulate();
+            replayAfterTick();
+        }
+    }
+    stopReplay();
+    return opened;
+}
+
+/* Record a game in which the cursor aims the idle laser and fires it, then
+   play the recording back, from the start and from a snapshot, and check
+   that no tick's hash differs */
+void testReplay ()
+{
+    char path[] = "/tmp/brick-breaker-self-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        expect(false, "cannot create a temporary replay");
+        return;
+    }
+    close(fd);
+
+    const long ticks = 2*REPLAY_SNAPSHOT_TICKS + 100;
+    Options saved_options = options;    // openReplay points these at the replay
+    LevelHeader header;
+    startTestGame(header);
+    bool recording = startRecording(path, true);
+    expect(recording, "cannot record a replay");
+#ifdef COUNT_ALLOCATIONS
+    long allocations = 0;
+#endif
+    for (long tick = 0; recording && tick < ticks; tick++) {
+        if (tick == 100)
+            aimCursor(2, 3);
+        if (tick == 150)
+            aimCursor(1, -2);
+        if (tick == 200)
+            fire_requested = true;
+#ifdef COUNT_ALLOCATIONS
+        allocation_count = 0;
+#endif
+        replayBeforeTick();
+        simulate();
+        replayAfterTick();
+        // Let the writer keep up, as it does at the game's tick rate
+        while (snapshot_writer.pending)
+            this_thread::yield();
+#ifdef COUNT_ALLOCATIONS
+        if (tick > 2)
+            allocations += allocation_count;
+#endif
+    }
+    stopReplay();
+#ifdef COUNT_ALLOCATIONS
+    char what[128];
+    snprintf(what, sizeof(what), "recording a replay made %ld heap allocations", allocations);
+    expect(allocations == 0, what);
+#endif
+    expect(snapshot_writer.index.size() == 3, "the replay did not index a snapshot every REPLAY_SNAPSHOT_TICKS");
+
+    if (recording && playTestReplay(path, header, 0)) {
+        expect(!replay.diverged, "a recorded game diverged when played back");
+        expect(sim_tick == ticks, "the replay did not play to its end");
+        playTestReplay(path, header, ticks - 50);
+        expect(!replay.diverged, "a recorded game diverged when played back from a snapshot");
+    } else
+        expect(false, "cannot play the recorded replay back");
+    unlink(path);
+    options = saved_options;
+    level = Level();
+}
+
+#ifdef COUNT_ALLOCATIONS
+/* The worst case maxLiveBlocks allows for, a block spawning every tick and
+   all of them falling at the slowest speed, must fit in what main reserves,
+   both in play and in a snapshot */
+void testAllocations ()
+{
+    LevelHeader header = {};
+    header.spawn_interval = 0.5/SIM_HZ;
+    header.spawn_y = 4.5;
+    header.min_block_speed = 0.005;
+    level.header = &header;
+    size_t max_blocks = maxLiveBlocks(header);
+    clearBlocks(3, -3);
+    reserveBlocks(max_blocks);
+    WorldSnapshot world;
+    world.block_x.reserve(max_blocks);
+    world.block_base_y.reserve(max_blocks);
+    world.block_color.reserve(max_blocks);
+    blockSpeed = header.min_block_speed;
+
+    allocation_count = 0;
+    for (size_t tick=0; tick<3*max_blocks; tick++) {
+        simulate();
+        captureSnapshot(world, sim_tick);
+    }
+    long allocations = allocation_count;
+    level = Level();
+    char what[128];
+    snprintf(what, sizeof(what), "spawning and falling made %ld heap allocations", allocations);
+    expect(allocations == 0, what);
+    snprintf(what, sizeof(what), "%zu blocks in play, more than the %zu reserved", block_x.size(), max_blocks);
+    expect(block_x.size() <= max_blocks, what);
+}
+#endif
+
+int runSelfTest ()
+{
+    testScoring();
+    testLaser();
+    testReplay();
+#ifdef COUNT_ALLOCATIONS
+    testAllocations();
+#endif
+    if (self_test_failures)
+        printf("self-test: %d failed\n", self_test_failures);
+    else
+        printf("self-test: all passed\n");
+    return self_test_failures ? 1 : 0;
+}
+
+/**************************
+ * Rendering              *
+ **************************/
+
+atomic<bool> render_stop(false);
+
+/* Lets an idle render thread sleep until the main thread has something new */
+mutex render_wake_mutex;
+condition_variable render_wake;
+
+void wakeRenderer ()
+{
+    lock_guard<mutex> lock(render_wake_mutex);
+    render_wake.notify_one();
+}
+
+/* Frames timed at startup to tell whether vsync is actually pacing us */
+#define VSYNC_CHECK_FRAMES 120
+
+/* Sleep most of the way to the deadline, then spin the last stretch, since
+   sleeping alone overshoots by up to a scheduler tick */
+void sleepUntilPrecise (chrono::steady_clock::time_point deadline)
+{
+    const chrono::microseconds spin(1500);
+    if (deadline - chrono::steady_clock::now() > spin)
+        this_thread::sleep_until(deadline - spin);
+    while (chrono::steady_clock::now() < deadline)
+        this_thread::yield();
+}
+
+/* Frame timings, averaged and printed every PROFILE_INTERVAL seconds with --profile */
+#define PROFILE_INTERVAL 5.0
+
+struct FrameProfile {
+    int frames;
+    double gpu_wait_ms;         // blocked on a fence for the GPU to catch up
+    double cpu_ms;              // building and submitting the frame
+    double submit_ms;           // of that, inside the renderer backend
+    double swap_ms;             // presenting it, glfwSwapBuffers for GL
+    long draw_calls;
+    long blocks_culled, mirrors_culled;
+    long transforms;            // scene nodes whose world transform was recomputed
+    double start;
+} profile;
+
+double nowMs ()
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void reportProfile ()
+{
+    double now = nowMs();
+    if (!options.profile || now - profile.start < PROFILE_INTERVAL*1000)
+        return;
+    if (profile.frames > 0)
+        printf("%5.1f fps  cpu %6.3f ms  submit %6.3f ms  gpu wait %6.3f ms  swap %6.3f ms  %4.1f draws  %4.1f transforms  culled %4.1f blocks %4.1f mirrors  scale %.2f  (%d in flight)\n",
+               profile.frames*1000.0/(now - profile.start), profile.cpu_ms/profile.frames, profile.submit_ms/profile.frames,
+               profile.gpu_wait_ms/profile.frames, profile.swap_ms/profile.frames,
+               (double) profile.draw_calls/profile.frames, (double) profile.transforms/profile.frames, (double) profile.blocks_culled/profile.frames,
+               (double) profile.mirrors_culled/profile.frames, resolutionScale(), options.frames_in_flight);
+    profile = FrameProfile();
+    profile.start = now;
+}
+
+/* Block until the GPU has finished the frame that used this fence slot, so
+   no more than options.frames_in_flight frames are ever queued */
+void waitForFence (GLsync &fence)
+{
+    if (!fence)
+        return;
+    double start = nowMs();
+    GLenum result;
+    do
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);   // 100 ms
+    while (result == GL_TIMEOUT_EXPIRED && !render_stop);
+    glDeleteSync(fence);
+    fence = 0;
+    profile.gpu_wait_ms += nowMs() - start;
+}
+
+#ifdef VULKAN_RENDERER
+/**************************
+ * Vulkan renderer        *
+ **************************/
+
+/* --renderer vulkan draws the render queue with Vulkan, in a window made
+   without a GL context. Every swapchain image gets a command buffer that
+   is recorded once, when the swapchain is made: it clears, then draws each
+   mesh with one vkCmdDrawIndirect, in the order the render queue sorts
+   them. Everything that changes between frames lives in a host visible
+   buffer per image: the VP matrix, the indirect draw counts, the object
+   and block instances and the laser paths' vertices. A frame writes that
+   buffer and submits the image's commands as they are, so it records
+   nothing. The shaders are SPIR-V that "make shaders" compiles from
+   Sample_VK.vert/.frag and Block_VK.vert. Lavapipe, Mesa's CPU driver,
+   runs it without a GPU. */
+
+/* The meshes in the order the render queue draws them, by layer then mesh */
+static const RenderMesh VULKAN_DRAW_ORDER[NUM_RENDER_MESHES] = { MESH_LASER, MESH_RED_BASKET, MESH_GREEN_BASKET, MESH_TURRET,
+                                                MESH_MIRROR, MESH_BLOCKS, MESH_AIM_PREVIEW, MESH_LASER_BEAM };
+
+/* GL clip space to Vulkan's, where y points down and depth runs from 0 to 1 */
+glm::mat4 vulkanClip ()
+{
+    glm::mat4 clip(1.0f);
+    clip[1][1] = -1;
+    clip[2][2] = 0.5f;
+    clip[3][2] = 0.5f;
+    return clip;
+}
+
+/* The uniform block of Sample_VK.vert and Block_VK.vert, std140 */
+struct VulkanUniforms {
+    glm::mat4 VP;
+    GLfloat palette[3][4];
+};
+
+/* Block_VK.vert's instance: the block's position this frame, and its kind */
+struct VulkanBlock {
+    GLfloat x, y, kind;
+};
+
+/* A swapchain image and the frame data its command buffer reads */
+struct VulkanImage {
+    VkImage image;
+    VkImageView view;
+    VkFramebuffer framebuffer;
+    VkCommandBuffer commands;       // recorded once, by recordVulkanImage
+    VkSemaphore rendered;           // presenting waits for it
+    VkFence fence;                  // of the last frame drawn into it, owned by a frame slot
+    VkBuffer buffer;                // host visible, laid out as VulkanRenderer's offsets say
+    VkDeviceMemory memory;
+    unsigned char *mapped;
+    VkDescriptorSet descriptors;
+};
+
+struct VulkanRenderer {
+    VkInstance instance;
+    VkSurfaceKHR surface;
+    VkPhysicalDevice gpu;
+    VkDevice device;
+    uint32_t queue_family;          // graphics and present
+    VkQueue queue;
+    VkSurfaceFormatKHR format;
+    VkRenderPass render_pass;
+    VkDescriptorSetLayout set_layout;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline objects, blocks, paths;
+    VkBuffer meshes;                // every mesh's vertices, written once
+    VkDeviceMemory mesh_memory;
+    uint32_t mesh_first[NUM_RENDER_MESHES];     // first vertex of each mesh in it
+    VkCommandPool command_pool;
+    VkDescriptorPool descriptor_pool;
+
+    VkSwapchainKHR swapchain;
+    VkExtent2D extent;
+    int width, height;              // viewport it was made for, which the surface may round
+    vector <VulkanImage> images;
+    uint32_t image;                 // acquired for this frame, or NO_VULKAN_IMAGE
+    bool stale;                     // the swapchain no longer matches the window
+
+    VkSemaphore acquired[MAX_FRAMES_IN_FLIGHT];
+    VkFence frame_fences[MAX_FRAMES_IN_FLIGHT];
+
+    // Where each part of the frame data starts in an image's buffer
+    VkDeviceSize indirect_offset, object_offset, block_offset, path_offset, buffer_size;
+    // Each mesh's instances have their own slots, since indirect draws
+    // cannot start past instance 0 without drawIndirectFirstInstance
+    int instance_first[NUM_RENDER_MESHES], instance_slots[NUM_RENDER_MESHES];
+    int max_blocks;
+    vector <int> visible;           // blocks in view
+} vulkan;
+
+#define NO_VULKAN_IMAGE UINT32_MAX
+
+/* For calls that only fail when the driver runs out of memory or is lost:
+   there is nothing to fall back to, so stop with the call that failed */
+#define VK_CHECK(call) checkVulkan((call), #call)
+
+void checkVulkan (VkResult result, const char *call)
+{
+    if (result == VK_SUCCESS)
+        return;
+    fprintf(stderr, "%s failed with VkResult %d\n", call, (int) result);
+    exit(EXIT_FAILURE);
+}
+
+uint32_t vulkanMemoryType (uint32_t type_bits, VkMemoryPropertyFlags properties)
+{
+    VkPhysicalDeviceMemoryProperties memory;
+    vkGetPhysicalDeviceMemoryProperties(vulkan.gpu, &memory);
+    for (uint32_t i=0; i<memory.memoryTypeCount; i++)
+        if ((type_bits & 1u << i) && (memory.memoryTypes[i].propertyFlags & properties) == properties)
+            return i;
+    checkVulkan(VK_ERROR_OUT_OF_DEVICE_MEMORY, "vulkanMemoryType");
+    return 0;
+}
+
+/* A host visible, coherent buffer, mapped for as long as it lives */
+void createVulkanBuffer (VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer &buffer, VkDeviceMemory &memory, unsigned char *&mapped)
+{
+    VulkanRenderer &v = vulkan;
+    VkBufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkCreateBuffer(v.device, &info, NULL, &buffer));
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(v.device, buffer, &requirements);
+    VkMemoryAllocateInfo allocate = {};
+    allocate.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocate.allocationSize = requirements.size;
+    allocate.memoryTypeIndex = vulkanMemoryType(requirements.memoryTypeBits,
+                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    VK_CHECK(vkAllocateMemory(v.device, &allocate, NULL, &memory));
+    VK_CHECK(vkBindBufferMemory(v.device, buffer, memory, 0));
+    void *data;
+    VK_CHECK(vkMapMemory(v.device, memory, 0, size, 0, &data));
+    mapped = (unsigned char*) data;
+}
+
+VkShaderModule loadSpirv (const char *path)
+{
+    string code = readShaderSource(path);
+    if (code.empty() || code.size() % 4) {
+        fprintf(stderr, "%s is not SPIR-V, run \"make shaders\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    vector <uint32_t> words(code.size() / 4);
+    memcpy(words.data(), code.data(), code.size());
+    VkShaderModuleCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    info.codeSize = code.size();
+    info.pCode = words.data();
+    VkShaderModule module;
+    VK_CHECK(vkCreateShaderModule(vulkan.device, &info, NULL, &module));
+    return module;
+}
+
+/* Binding 0 is per vertex, binding 1 per instance with the attribute at instance_location */
+VkPipeline createVulkanPipeline (VkShaderModule vertex, VkShaderModule fragment, VkPrimitiveTopology topology,
+                                 uint32_t instance_location, VkFormat instance_format, uint32_t instance_stride)
+{
+    VulkanRenderer &v = vulkan;
+    VkPipelineShaderStageCreateInfo stages[2] = {};
+    stages[0].sType = stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = vertex;
+    stages[0].pName = "main";
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = fragment;
+    stages[1].pName = "main";
+
+    VkVertexInputBindingDescription bindings[2] = {
+        { 0, 3*sizeof(GLfloat), VK_VERTEX_INPUT_RATE_VERTEX },
+        { 1, instance_stride, VK_VERTEX_INPUT_RATE_INSTANCE },
+    };
+    VkVertexInputAttributeDescription attributes[2] = {
+        { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
+        { instance_location, 1, instance_format, 0 },
+    };
+    VkPipelineVertexInputStateCreateInfo input = {};
+    input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    input.vertexBindingDescriptionCount = 2;
+    input.pVertexBindingDescriptions = bindings;
+    input.vertexAttributeDescriptionCount = 2;
+    input.pVertexAttributeDescriptions = attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo assembly = {};
+    assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    assembly.topology = topology;
+
+    // Viewport and scissor are set by the recorded commands, so a resize keeps the pipelines
+    VkPipelineViewportStateCreateInfo viewport = {};
+    viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport.viewportCount = 1;
+    viewport.scissorCount = 1;
+    VkDynamicState dynamic_states[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamic = {};
+    dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic.dynamicStateCount = 2;
+    dynamic.pDynamicStates = dynamic_states;
+
+    VkPipelineRasterizationStateCreateInfo raster = {};
+    raster.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    raster.polygonMode = VK_POLYGON_MODE_FILL;
+    raster.cullMode = VK_CULL_MODE_NONE;
+    raster.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    raster.lineWidth = 1;
+
+    VkPipelineMultisampleStateCreateInfo multisample = {};
+    multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    // No depth test and no blending, as in the GL path: layers are drawn in order
+    VkPipelineColorBlendAttachmentState attachment = {};
+    attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                                VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    VkPipelineColorBlendStateCreateInfo blend = {};
+    blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    blend.attachmentCount = 1;
+    blend.pAttachments = &attachment;
+
+    VkGraphicsPipelineCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    info.stageCount = 2;
+    info.pStages = stages;
+    info.pVertexInputState = &input;
+    info.pInputAssemblyState = &assembly;
+    info.pViewportState = &viewport;
+    info.pRasterizationState = &raster;
+    info.pMultisampleState = &multisample;
+    info.pColorBlendState = &blend;
+    info.pDynamicState = &dynamic;
+    info.layout = v.pipeline_layout;
+    info.renderPass = v.render_pass;
+    VkPipeline pipeline;
+    VK_CHECK(vkCreateGraphicsPipelines(v.device, VK_NULL_HANDLE, 1, &info, NULL, &pipeline));
+    return pipeline;
+}
+
+/* The first device with a queue that can both draw and present to the window */
+bool pickVulkanDevice ()
+{
+    VulkanRenderer &v = vulkan;
+    uint32_t count = 0;
+    vkEnumeratePhysicalDevices(v.instance, &count, NULL);
+    vector <VkPhysicalDevice> gpus(count);
+    vkEnumeratePhysicalDevices(v.instance, &count, gpus.data());
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t families = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(gpus[i], &families, NULL);
+        vector <VkQueueFamilyProperties> properties(families);
+        vkGetPhysicalDeviceQueueFamilyProperties(gpus[i], &families, properties.data());
+        for (uint32_t family=0; family<families; family++) {
+            VkBool32 present = VK_FALSE;
+            vkGetPhysicalDeviceSurfaceSupportKHR(gpus[i], family, v.surface, &present);
+            if ((properties[family].queueFlags & VK_QUEUE_GRAPHICS_BIT) && present) {
+                v.gpu = gpus[i];
+                v.queue_family = family;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void createVulkanDevice ()
+{
+    VulkanRenderer &v = vulkan;
+    VkApplicationInfo app = {};
+    app.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app.pApplicationName = "Brick Breaker";
+    app.apiVersion = VK_API_VERSION_1_0;
+    uint32_t extension_count = 0;
+    const char **extensions = glfwGetRequiredInstanceExtensions(&extension_count);
+    VkInstanceCreateInfo instance = {};
+    instance.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instance.pApplicationInfo = &app;
+    instance.enabledExtensionCount = extension_count;
+    instance.ppEnabledExtensionNames = extensions;
+    VK_CHECK(vkCreateInstance(&instance, NULL, &v.instance));
+    VK_CHECK(glfwCreateWindowSurface(v.instance, window, NULL, &v.surface));
+    if (!pickVulkanDevice()) {
+        fprintf(stderr, "No Vulkan device can present to the window\n");
+        exit(EXIT_FAILURE);
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(v.gpu, &properties);
+    renderer_device = properties.deviceName;
+    cout << "VULKAN DEVICE: " << properties.deviceName << endl;
+
+    float priority = 1;
+    VkDeviceQueueCreateInfo queue = {};
+    queue.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue.queueFamilyIndex = v.queue_family;
+    queue.queueCount = 1;
+    queue.pQueuePriorities = &priority;
+    const char *swapchain_extension = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+    VkDeviceCreateInfo device = {};
+    device.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    device.queueCreateInfoCount = 1;
+    device.pQueueCreateInfos = &queue;
+    device.enabledExtensionCount = 1;
+    device.ppEnabledExtensionNames = &swapchain_extension;
+    VK_CHECK(vkCreateDevice(v.gpu, &device, NULL, &v.device));
+    vkGetDeviceQueue(v.device, v.queue_family, 0, &v.queue);
+
+    // Plain 8 bit BGRA like the GL default framebuffer, without sRGB conversion
+    uint32_t format_count = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(v.gpu, v.surface, &format_count, NULL);
+    vector <VkSurfaceFormatKHR> formats(format_count);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(v.gpu, v.surface, &format_count, formats.data());
+    v.format = formats[0];
+    for (uint32_t i=0; i<format_count; i++)
+        if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM)
+            v.format = formats[i];
+}
+
+void createVulkanRenderPass ()
+{
+    VulkanRenderer &v = vulkan;
+    VkAttachmentDescription color = {};
+    color.format = v.format.format;
+    color.samples = VK_SAMPLE_COUNT_1_BIT;
+    color.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    color.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkAttachmentReference reference = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &reference;
+    // The image is written once the acquire semaphore the submit waits on has fired
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkRenderPassCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    info.attachmentCount = 1;
+    info.pAttachments = &color;
+    info.subpassCount = 1;
+    info.pSubpasses = &subpass;
+    info.dependencyCount = 1;
+    info.pDependencies = &dependency;
+    VK_CHECK(vkCreateRenderPass(v.device, &info, NULL, &v.render_pass));
+}
+
+/* The uniform block, the pipelines that draw objects, blocks and laser paths, and the meshes */
+void createVulkanPipelines ()
+{
+    VulkanRenderer &v = vulkan;
+    VkDescriptorSetLayoutBinding uniforms = {};
+    uniforms.binding = 0;
+    uniforms.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    uniforms.descriptorCount = 1;
+    uniforms.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    VkDescriptorSetLayoutCreateInfo set = {};
+    set.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set.bindingCount = 1;
+    set.pBindings = &uniforms;
+    VK_CHECK(vkCreateDescriptorSetLayout(v.device, &set, NULL, &v.set_layout));
+
+    // The mesh's color, which never changes, so it is pushed when the commands are recorded
+    VkPushConstantRange color = { VK_SHADER_STAGE_VERTEX_BIT, 0, 4*sizeof(GLfloat) };
+    VkPipelineLayoutCreateInfo layout = {};
+    layout.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout.setLayoutCount = 1;
+    layout.pSetLayouts = &v.set_layout;
+    layout.pushConstantRangeCount = 1;
+    layout.pPushConstantRanges = &color;
+    VK_CHECK(vkCreatePipelineLayout(v.device, &layout, NULL, &v.pipeline_layout));
+
+    VkShaderModule object_shader = loadSpirv("Sample_VK.vert.spv");
+    VkShaderModule block_shader = loadSpirv("Block_VK.vert.spv");
+    VkShaderModule fragment = loadSpirv("Sample_VK.frag.spv");
+    v.objects = createVulkanPipeline(object_shader, fragment, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+                                     3, VK_FORMAT_R32G32B32A32_SFLOAT, sizeof(ObjectInstance));
+    v.blocks = createVulkanPipeline(block_shader, fragment, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+                                    2, VK_FORMAT_R32G32B32_SFLOAT, sizeof(VulkanBlock));
+    // Laser paths are in world space already and take the identity instance
+    v.paths = createVulkanPipeline(object_shader, fragment, VK_PRIMITIVE_TOPOLOGY_LINE_STRIP,
+                                   3, VK_FORMAT_R32G32B32A32_SFLOAT, sizeof(ObjectInstance));
+    vkDestroyShaderModule(v.device, object_shader, NULL);
+    vkDestroyShaderModule(v.device, block_shader, NULL);
+    vkDestroyShaderModule(v.device, fragment, NULL);
+
+    // Every mesh's vertices in one buffer, blocks included
+    uint32_t vertices = 0;
+    for (int mesh=0; mesh<NUM_RENDER_MESHES; mesh++) {
+        const VAO *vao = mesh == MESH_BLOCKS ? blocks.mesh.get() : renderMesh((RenderMesh) mesh);
+        v.mesh_first[mesh] = vertices;
+        if (vao)
+            vertices += vao->NumVertices;
+    }
+    unsigned char *mapped;
+    createVulkanBuffer(max(vertices, 1u)*3*sizeof(GLfloat), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, v.meshes, v.mesh_memory, mapped);
+    for (int mesh=0; mesh<NUM_RENDER_MESHES; mesh++) {
+        const VAO *vao = mesh == MESH_BLOCKS ? blocks.mesh.get() : renderMesh((RenderMesh) mesh);
+        if (vao)
+            memcpy(mapped + v.mesh_first[mesh]*3*sizeof(GLfloat), vao->Vertices, vao->NumVertices*3*sizeof(GLfloat));
+    }
+}
+
+/* The commands an image runs every frame it is drawn; only its buffer changes */
+void recordVulkanImage (VulkanImage &image)
+{
+    VulkanRenderer &v = vulkan;
+    VkCommandBufferBeginInfo begin = {};
+    begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK(vkBeginCommandBuffer(image.commands, &begin));
+
+    VkClearValue clear = {};
+    clear.color.float32[0] = 0.3f;
+    clear.color.float32[1] = 0.1f;
+    clear.color.float32[2] = 0.2f;
+    clear.color.float32[3] = 0.7f;
+    VkRenderPassBeginInfo pass = {};
+    pass.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    pass.renderPass = v.render_pass;
+    pass.framebuffer = image.framebuffer;
+    pass.renderArea.extent = v.extent;
+    pass.clearValueCount = 1;
+    pass.pClearValues = &clear;
+    vkCmdBeginRenderPass(image.commands, &pass, VK_SUBPASS_CONTENTS_INLINE);
+
+    VkViewport viewport = { 0, 0, (float) v.extent.width, (float) v.extent.height, 0, 1 };
+    VkRect2D scissor = { { 0, 0 }, v.extent };
+    vkCmdSetViewport(image.commands, 0, 1, &viewport);
+    vkCmdSetScissor(image.commands, 0, 1, &scissor);
+    vkCmdBindDescriptorSets(image.commands, VK_PIPELINE_BIND_POINT_GRAPHICS, v.pipeline_layout, 0, 1, &image.descriptors, 0, NULL);
+
+    VkPipeline bound = VK_NULL_HANDLE;
+    for (int i=0; i<NUM_RENDER_MESHES; i++) {
+        RenderMesh mesh = VULKAN_DRAW_ORDER[i];
+        bool path = mesh == MESH_AIM_PREVIEW || mesh == MESH_LASER_BEAM;
+        VkPipeline pipeline = mesh == MESH_BLOCKS ? v.blocks : path ? v.paths : v.objects;
+        if (pipeline != bound)
+            vkCmdBindPipeline(image.commands, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        bound = pipeline;
+
+        VkBuffer buffers[2] = { path ? image.buffer : v.meshes, image.buffer };
+        VkDeviceSize offsets[2] = { path ? v.path_offset : 0,
+                                    mesh == MESH_BLOCKS ? v.block_offset : v.object_offset + v.instance_first[mesh]*sizeof(ObjectInstance) };
+        vkCmdBindVertexBuffers(image.commands, 0, 2, buffers, offsets);
+        GLfloat color[4] = { 0, 0, 0, 1 };
+        if (mesh == MESH_AIM_PREVIEW)
+            color[0] = 0.45, color[1] = 0.35, color[2] = 0.55;
+        else if (mesh == MESH_LASER_BEAM)
+            color[0] = 0.6, color[1] = 0.2, color[2] = 0.9;
+        else if (mesh != MESH_BLOCKS)
+            memcpy(color, renderMesh(mesh)->Color, 3*sizeof(GLfloat));
+        vkCmdPushConstants(image.commands, v.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(color), color);
+        vkCmdDrawIndirect(image.commands, image.buffer, v.indirect_offset + mesh*sizeof(VkDrawIndirectCommand),
+                          1, sizeof(VkDrawIndirectCommand));
+    }
+
+    vkCmdEndRenderPass(image.commands);
+    VK_CHECK(vkEndCommandBuffer(image.commands));
+}
+
+void destroyVulkanSwapchain ()
+{
+    VulkanRenderer &v = vulkan;
+    vkDeviceWaitIdle(v.device);
+    for (int i=0; i<v.images.size(); i++) {
+        VulkanImage &image = v.images[i];
+        vkFreeCommandBuffers(v.device, v.command_pool, 1, &image.commands);
+        vkDestroyFramebuffer(v.device, image.framebuffer, NULL);
+        vkDestroyImageView(v.device, image.view, NULL);
+        vkDestroySemaphore(v.device, image.rendered, NULL);
+        vkDestroyBuffer(v.device, image.buffer, NULL);
+        vkFreeMemory(v.device, image.memory, NULL);
+    }
+    v.images.clear();
+    vkDestroyDescriptorPool(v.device, v.descriptor_pool, NULL);
+    v.descriptor_pool = VK_NULL_HANDLE;
+}
+
+/* (Re)create the swapchain for the window's size, with an image's resources and commands for each image */
+void createVulkanSwapchain ()
+{
+    VulkanRenderer &v = vulkan;
+    VkSwapchainKHR old = v.swapchain;
+    if (old)
+        destroyVulkanSwapchain();
+    v.stale = false;
+    v.width = viewport_width;
+    v.height = viewport_height;
+
+    VkSurfaceCapabilitiesKHR capabilities;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(v.gpu, v.surface, &capabilities));
+    v.extent = capabilities.currentExtent;
+    if (v.extent.width == UINT32_MAX) {
+        v.extent.width = min(max((uint32_t) viewport_width, capabilities.minImageExtent.width), capabilities.maxImageExtent.width);
+        v.extent.height = min(max((uint32_t) viewport_height, capabilities.minImageExtent.height), capabilities.maxImageExtent.height);
+    }
+    v.swapchain = VK_NULL_HANDLE;
+    if (v.extent.width == 0 || v.extent.height == 0) {
+        vkDestroySwapchainKHR(v.device, old, NULL);
+        return;     // minimised, nothing to draw into until it is restored
+    }
+
+    // FIFO is vsync; without it the fastest mode there is, since --fps paces on its own
+    uint32_t mode_count = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(v.gpu, v.surface, &mode_count, NULL);
+    vector <VkPresentModeKHR> modes(mode_count);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(v.gpu, v.surface, &mode_count, modes.data());
+    VkPresentModeKHR mode = VK_PRESENT_MODE_FIFO_KHR;
+    for (uint32_t i=0; i<mode_count && !options.vsync; i++)
+        if (modes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR || (modes[i] == VK_PRESENT_MODE_MAILBOX_KHR && mode == VK_PRESENT_MODE_FIFO_KHR))
+            mode = modes[i];
+
+    VkSwapchainCreateInfoKHR info = {};
+    info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    info.surface = v.surface;
+    info.minImageCount = max(capabilities.minImageCount, (uint32_t) options.frames_in_flight + 1);
+    if (capabilities.maxImageCount > 0)
+        info.minImageCount = min(info.minImageCount, capabilities.maxImageCount);
+    info.imageFormat = v.format.format;
+    info.imageColorSpace = v.format.colorSpace;
+    info.imageExtent = v.extent;
+    info.imageArrayLayers = 1;
+    info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    info.preTransform = capabilities.currentTransform;
+    info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    info.presentMode = mode;
+    info.clipped = VK_TRUE;
+    info.oldSwapchain = old;
+    VK_CHECK(vkCreateSwapchainKHR(v.device, &info, NULL, &v.swapchain));
+    if (old)
+        vkDestroySwapchainKHR(v.device, old, NULL);
+
+    uint32_t count = 0;
+    vkGetSwapchainImagesKHR(v.device, v.swapchain, &count, NULL);
+    vector <VkImage> images(count);
+    vkGetSwapchainImagesKHR(v.device, v.swapchain, &count, images.data());
+    v.images.resize(count);
+
+    VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, count };
+    VkDescriptorPoolCreateInfo pool = {};
+    pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool.maxSets = count;
+    pool.poolSizeCount = 1;
+    pool.pPoolSizes = &pool_size;
+    VK_CHECK(vkCreateDescriptorPool(v.device, &pool, NULL, &v.descriptor_pool));
+
+    for (uint32_t i=0; i<count; i++) {
+        VulkanImage &image = v.images[i];
+        image.image = images[i];
+        image.fence = VK_NULL_HANDLE;
+
+        VkImageViewCreateInfo view = {};
+        view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view.image = image.image;
+        view.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view.format = v.format.format;
+        view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        view.subresourceRange.levelCount = 1;
+        view.subresourceRange.layerCount = 1;
+        VK_CHECK(vkCreateImageView(v.device, &view, NULL, &image.view));
+
+        VkFramebufferCreateInfo framebuffer = {};
+        framebuffer.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebuffer.renderPass = v.render_pass;
+        framebuffer.attachmentCount = 1;
+        framebuffer.pAttachments = &image.view;
+        framebuffer.width = v.extent.width;
+        framebuffer.height = v.extent.height;
+        framebuffer.layers = 1;
+        VK_CHECK(vkCreateFramebuffer(v.device, &framebuffer, NULL, &image.framebuffer));
+
+        VkSemaphoreCreateInfo semaphore = {};
+        semaphore.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VK_CHECK(vkCreateSemaphore(v.device, &semaphore, NULL, &image.rendered));
+
+        createVulkanBuffer(v.buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, image.buffer, image.memory, image.mapped);
+        // Instance 0 is the identity, for the laser paths
+        ObjectInstance identity = { 1, 0, 0, 0 };
+        memcpy(image.mapped + v.object_offset, &identity, sizeof(identity));
+
+        VkDescriptorSetAllocateInfo allocate = {};
+        allocate.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocate.descriptorPool = v.descriptor_pool;
+        allocate.descriptorSetCount = 1;
+        allocate.pSetLayouts = &v.set_layout;
+        VK_CHECK(vkAllocateDescriptorSets(v.device, &allocate, &image.descriptors));
+        VkDescriptorBufferInfo uniforms = { image.buffer, 0, sizeof(VulkanUniforms) };
+        VkWriteDescriptorSet write = {};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = image.descriptors;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        write.pBufferInfo = &uniforms;
+        vkUpdateDescriptorSets(v.device, 1, &write, 0, NULL);
+
+        VkCommandBufferAllocateInfo commands = {};
+        commands.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commands.commandPool = v.command_pool;
+        commands.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commands.commandBufferCount = 1;
+        VK_CHECK(vkAllocateCommandBuffers(v.device, &commands, &image.commands));
+        recordVulkanImage(image);
+    }
+}
+
+void startVulkanRenderer ()
+{
+    VulkanRenderer &v = vulkan;
+    if (!glfwVulkanSupported()) {
+        fprintf(stderr, "Vulkan is not available, check VK_ICD_FILENAMES\n");
+        exit(EXIT_FAILURE);
+    }
+    {
+        StartupTimer timer("create device", "render");
+        createVulkanDevice();
+    }
+
+    // An image's buffer: uniforms, indirect draws, object instances, blocks,
+    // then the two laser paths. The paths share the identity instance in slot 0
+    int objects = 1;
+    for (int mesh=0; mesh<NUM_RENDER_MESHES; mesh++) {
+        bool path = mesh == MESH_AIM_PREVIEW || mesh == MESH_LASER_BEAM;
+        v.instance_first[mesh] = path ? 0 : objects;
+        v.instance_slots[mesh] = path || mesh == MESH_BLOCKS ? 0 : mesh == MESH_MIRROR ? level.header->num_mirrors : 1;
+        objects += v.instance_slots[mesh];
+    }
+    v.max_blocks = maxLiveBlocks(*level.header);
+    v.indirect_offset = sizeof(VulkanUniforms);
+    v.object_offset = v.indirect_offset + NUM_RENDER_MESHES*sizeof(VkDrawIndirectCommand);
+    v.block_offset = v.object_offset + objects*sizeof(ObjectInstance);
+    v.path_offset = v.block_offset + v.max_blocks*sizeof(VulkanBlock);
+    v.buffer_size = v.path_offset + 2*MAX_LASER_POINTS*3*sizeof(GLfloat);
+    v.visible.reserve(v.max_blocks);
+
+    {
+        StartupTimer timer("create pipelines", "render");
+        createVulkanRenderPass();
+        createVulkanPipelines();
+    }
+    VkCommandPoolCreateInfo pool = {};
+    pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool.queueFamilyIndex = v.queue_family;
+    VK_CHECK(vkCreateCommandPool(v.device, &pool, NULL, &v.command_pool));
+    VkSemaphoreCreateInfo semaphore = {};
+    semaphore.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VkFenceCreateInfo fence = {};
+    fence.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    for (int i=0; i<MAX_FRAMES_IN_FLIGHT; i++) {
+        VK_CHECK(vkCreateSemaphore(v.device, &semaphore, NULL, &v.acquired[i]));
+        VK_CHECK(vkCreateFence(v.device, &fence, NULL, &v.frame_fences[i]));
+    }
+    v.swapchain = VK_NULL_HANDLE;
+    v.image = NO_VULKAN_IMAGE;
+    StartupTimer timer("create swapchain", "render");
+    createVulkanSwapchain();
+}
+
+void stopVulkanRenderer ()
+{
+    VulkanRenderer &v = vulkan;
+    destroyVulkanSwapchain();
+    vkDestroySwapchainKHR(v.device, v.swapchain, NULL);
+    for (int i=0; i<MAX_FRAMES_IN_FLIGHT; i++) {
+        vkDestroySemaphore(v.device, v.acquired[i], NULL);
+        vkDestroyFence(v.device, v.frame_fences[i], NULL);
+    }
+    vkDestroyCommandPool(v.device, v.command_pool, NULL);
+    vkDestroyBuffer(v.device, v.meshes, NULL);
+    vkFreeMemory(v.device, v.mesh_memory, NULL);
+    vkDestroyPipeline(v.device, v.objects, NULL);
+    vkDestroyPipeline(v.device, v.blocks, NULL);
+    vkDestroyPipeline(v.device, v.paths, NULL);
+    vkDestroyPipelineLayout(v.device, v.pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(v.device, v.set_layout, NULL);
+    vkDestroyRenderPass(v.device, v.render_pass, NULL);
+    vkDestroyDevice(v.device, NULL);
+    vkDestroySurfaceKHR(v.instance, v.surface, NULL);
+    vkDestroyInstance(v.instance, NULL);
+}
+
+/* Wait for the frame that last used this slot's fence and semaphore, which
+   also keeps no more than options.frames_in_flight frames queued */
+void beginVulkanFrame (long frame)
+{
+    VulkanRenderer &v = vulkan;
+    double start = nowMs();
+    VK_CHECK(vkWaitForFences(v.device, 1, &v.frame_fences[frame % options.frames_in_flight], VK_TRUE, UINT64_MAX));
+    profile.gpu_wait_ms += nowMs() - start;
+}
+
+void writeVulkanPath (const LaserPath &path, GLfloat *vertices, VkDrawIndirectCommand &draw)
+{
+    for (int i=0; i<path.count; i++) {
+        vertices[3*i] = toFloat(path.x[i]);
+        vertices[3*i+1] = toFloat(path.y[i]);
+        vertices[3*i+2] = 0;
+    }
+    draw.vertexCount = path.count >= 2 ? path.count : 0;
+    draw.instanceCount = 1;
+}
+
+/* Write this frame's data into the acquired image's buffer and submit its commands */
+void drawVulkanFrame (const WorldSnapshot &world, long frame)
+{
+    VulkanRenderer &v = vulkan;
+    int slot = frame % options.frames_in_flight;
+    v.image = NO_VULKAN_IMAGE;
+    if (v.stale || v.width != viewport_width || v.height != viewport_height)
+        createVulkanSwapchain();
+    if (!v.swapchain)
+        return;
+
+    double start = nowMs();
+    VkResult acquired = vkAcquireNextImageKHR(v.device, v.swapchain, UINT64_MAX, v.acquired[slot], VK_NULL_HANDLE, &v.image);
+    if (acquired == VK_ERROR_OUT_OF_DATE_KHR) {
+        v.image = NO_VULKAN_IMAGE;
+        v.stale = true;
+        return;
+    }
+    if (acquired != VK_SUBOPTIMAL_KHR)
+        VK_CHECK(acquired);
+    VulkanImage &image = v.images[v.image];
+    if (image.fence && image.fence != v.frame_fences[slot])
+        VK_CHECK(vkWaitForFences(v.device, 1, &image.fence, VK_TRUE, UINT64_MAX));
+    image.fence = v.frame_fences[slot];
+    profile.gpu_wait_ms += nowMs() - start;
+
+    glm::mat4 VP;
+    ViewRect view = viewOf(world, VP);
+    VulkanUniforms *uniforms = (VulkanUniforms*) image.mapped;
+    uniforms->VP = vulkanClip() * VP;
+    for (int kind=0; kind<3; kind++)
+        memcpy(uniforms->palette[kind], BLOCK_PALETTE[kind], 3*sizeof(GLfloat));
+
+    // Every mesh gets its indirect draw written, with no instances if it was not queued
+    VkDrawIndirectCommand *draws = (VkDrawIndirectCommand*) (image.mapped + v.indirect_offset);
+    ObjectInstance *objects = (ObjectInstance*) (image.mapped + v.object_offset);
+    GLfloat *paths = (GLfloat*) (image.mapped + v.path_offset);
+    for (int mesh=0; mesh<NUM_RENDER_MESHES; mesh++) {
+        const VAO *vao = mesh == MESH_BLOCKS ? blocks.mesh.get() : renderMesh((RenderMesh) mesh);
+        draws[mesh].vertexCount = vao ? vao->NumVertices : 0;
+        draws[mesh].instanceCount = 0;
+        draws[mesh].firstVertex = v.mesh_first[mesh];
+        draws[mesh].firstInstance = 0;
+    }
+    // The paths' vertices are at path_offset, in the image's own buffer
+    draws[MESH_AIM_PREVIEW].firstVertex = 0;
+    draws[MESH_LASER_BEAM].firstVertex = MAX_LASER_POINTS;
+
+    queuePlayfield(world, view);
+    queueOverlay();
+    sortRenderQueue();
+    RenderQueue &q = render_queue;
+    int n = q.commands.size();
+    for (int i=0; i<n; ) {
+        uint64_t run = q.commands[i].key >> 32;
+        int end = i + 1;
+        while (end < n && q.commands[end].key >> 32 == run)
+            end++;
+        RenderMesh mesh = (RenderMesh) (run & 0xffff);
+        VkDrawIndirectCommand &draw = draws[mesh];
+        if (mesh == MESH_BLOCKS) {
+            cullBlocks(world, view, v.visible);
+            q.blocks_culled += world.block_x.size() - v.visible.size();
+            VulkanBlock *out = (VulkanBlock*) (image.mapped + v.block_offset);
+            int count = min((int) v.visible.size(), v.max_blocks);
+            for (int b=0; b<count; b++) {
+                int block = v.visible[b];
+                out[b].x = world.block_x[block];
+                out[b].y = world.block_base_y[block] - world.fall_distance;
+                out[b].kind = world.block_color[block];
+            }
+            draw.instanceCount = count;
+        }
+        else if (mesh == MESH_AIM_PREVIEW)
+            writeVulkanPath(world.aim_preview, paths, draw);
+        else if (mesh == MESH_LASER_BEAM)
+            writeVulkanPath(world.laser_beam, paths + 3*MAX_LASER_POINTS, draw);
+        else {
+            int count = min(end - i, v.instance_slots[mesh]);
+            for (int k=0; k<count; k++)
+                objects[v.instance_first[mesh] + k] = q.commands[i + k].instance;
+            draw.instanceCount = count;
+        }
+        if (draw.instanceCount && draw.vertexCount)
+            q.draw_calls++;
+        i = end;
+    }
+    q.commands.clear();
+
+    VK_CHECK(vkResetFences(v.device, 1, &v.frame_fences[slot]));
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.waitSemaphoreCount = 1;
+    submit.pWaitSemaphores = &v.acquired[slot];
+    submit.pWaitDstStageMask = &wait_stage;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &image.commands;
+    submit.signalSemaphoreCount = 1;
+    submit.pSignalSemaphores = &image.rendered;
+    VK_CHECK(vkQueueSubmit(v.queue, 1, &submit, v.frame_fences[slot]));
+}
+
+void presentVulkan (long frame)
+{
+    VulkanRenderer &v = vulkan;
+    if (v.image == NO_VULKAN_IMAGE)
+        return;
+    VkPresentInfoKHR present = {};
+    present.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    present.waitSemaphoreCount = 1;
+    present.pWaitSemaphores = &v.images[v.image].rendered;
+    present.swapchainCount = 1;
+    present.pSwapchains = &v.swapchain;
+    present.pImageIndices = &v.image;
+    VkResult result = vkQueuePresentKHR(v.queue, &present);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+        v.stale = true;
+    else
+        VK_CHECK(result);
+}
+#endif
+
+
+/**************************
+ * Renderer backends      *
+ **************************/
+
+/* Fences of the GL frames in flight, by frame % options.frames_in_flight */
+GLsync gl_frame_fences[MAX_FRAMES_IN_FLIGHT];
+
+void beginGLFrame (long frame)
+{
+    waitForFence(gl_frame_fences[frame % options.frames_in_flight]);
+}
+
+void drawGLFrame (const WorldSnapshot &world, long frame)
+{
+    beginFrameTiming(frame);
+    draw(world);
+    endFrameTiming();
+}
+
+void drawSoftwareFrame (const WorldSnapshot &world, long frame)
+{
+    drawSoftware(world);
+}
+
+void presentGL (long frame)
+{
+    // Swap Frame Buffer in double buffering
+    glfwSwapBuffers(window);
+    if (renderer->gl_draws)     // the CPU is done with a software frame once it is uploaded
+        gl_frame_fences[frame % options.frames_in_flight] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+static const Renderer RENDERERS[] = {
+    { "gl", 3, 3, true, startGLRenderer, stopGLRenderer, beginGLFrame, drawGLFrame, presentGL },
+    { "software", 3, 0, false, startSoftwareRenderer, stopSoftwareRenderer, beginGLFrame, drawSoftwareFrame, presentGL },
+#ifdef VULKAN_RENDERER
+    { "vulkan", 0, 0, false, startVulkanRenderer, stopVulkanRenderer, beginVulkanFrame, drawVulkanFrame, presentVulkan },
+#endif
+};
+
+const Renderer *findRenderer (const char *name)
+{
+    for (int i=0; i<sizeof(RENDERERS)/sizeof(RENDERERS[0]); i++)
+        if (strcmp(RENDERERS[i].name, name) == 0)
+            return &RENDERERS[i];
+    return NULL;
+}
+
+/* Owns the renderer, and the GL context if it has one: draws the newest
+   world snapshot every vsync while the main thread simulates the next tick */
+void renderLoop ()
+{
+    if (renderer->gl_major) {
+        glfwMakeContextCurrent(window);
+        {
+            StartupTimer timer("gladLoadGLLoader", "render");
+            gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+        }
+        glfwSwapInterval( options.vsync ? 1 : 0 );
+    }
+    initGL (window);
+
+    bool first_frame = true;
+    double bench_start = 0;     // --bench-frames times from the end of the first frame
+    double bench_submit_ms = 0; // and the submitting done since
+    long frame = 0;
+    profile.start = nowMs();
+    chrono::steady_clock::time_point next_frame = chrono::steady_clock::now();
+    double vsync_check_start = nowMs();
+    while (!render_stop)
+    {
+        // Wait before reading the snapshot so the frame shows the freshest aim
+        renderer->begin(frame);
+
+        double cpu_start = nowMs();
+        bool fresh = snapshots.acquire();
+        bool resized = applyViewport();
+        if (gameIdle() && !fresh && !resized && !first_frame)
+        {
+            // Nothing changed, redraw only when input or a resize arrives. The
+            // predicate is checked under the lock wakeRenderer takes, so a
+            // snapshot published after acquire() above still wakes us
+            unique_lock<mutex> lock(render_wake_mutex);
+            render_wake.wait(lock, [] { return render_stop || snapshots.hasFresh() || viewportStale(); });
+            next_frame = chrono::steady_clock::now();
+            continue;
+        }
+
+        // Draw commands; a backend that waits inside frame() adds that to gpu_wait_ms
+        render_queue.draw_calls = render_queue.blocks_culled = render_queue.mirrors_culled = 0;
+        double waited = profile.gpu_wait_ms, submit_start = nowMs();
+        renderer->frame(snapshots.readSlot(), frame);
+        waited = profile.gpu_wait_ms - waited;
+        double submit_ms = nowMs() - submit_start - waited;
+        profile.submit_ms += submit_ms;
+        if (!first_frame)
+            bench_submit_ms += submit_ms;
+        profile.draw_calls += render_queue.draw_calls;
+        profile.transforms += scene.updated;
+        profile.blocks_culled += render_queue.blocks_culled;
+        profile.mirrors_culled += render_queue.mirrors_culled;
+        double swap_start = nowMs();
+        profile.cpu_ms += swap_start - cpu_start - waited;
+        renderer->present(frame);
+        profile.swap_ms += nowMs() - swap_start;
+        profile.frames++;
+        reportProfile();
+        if (frame == VSYNC_CHECK_FRAMES && options.vsync && options.target_fps == 0 &&
+            nowMs() - vsync_check_start < VSYNC_CHECK_FRAMES*2.0)
+        {
+            // Over 500 fps with vsync on: the driver ignores the swap interval
+            printf("vsync is not working, capping at 60 fps\n");
+            options.target_fps = 60;
+        }
+        if (options.target_fps > 0)
+        {
+            next_frame += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0/options.target_fps));
+            if (next_frame < chrono::steady_clock::now())
+                next_frame = chrono::steady_clock::now();   // fell behind, do not try to catch up
+            sleepUntilPrecise(next_frame);
+        }
+        if(first_frame)
+        {
+            reportStartup();
+            first_frame = false;
+            bench_start = nowMs();
+        }
+        else if (frame == options.bench_frames)
+        {
+            double ms = nowMs() - bench_start;
+            printf("%ld frames in %.0f ms, %.3f ms per frame, %.3f ms of it submitting, with the %s renderer on %s\n",
+                   frame, ms, ms/frame, bench_submit_ms/frame, renderer->name, renderer_device.c_str());
+            glfwSetWindowShouldClose(window, GL_TRUE);
+        }
+#ifdef COUNT_ALLOCATIONS
+        checkAllocations("frame", frame);
+#endif
+        frame++;
+#ifdef DEV_BUILD
+        reloadChangedShaders(glfwGetTime());
+#endif
+    }
+
+    for (int i=0; i<MAX_FRAMES_IN_FLIGHT; i++)
+        if (gl_frame_fences[i])
+            glDeleteSync(gl_frame_fences[i]);
+    destroyGL();
+    if (renderer->gl_major)
+        glfwMakeContextCurrent(NULL);
+}
+
+/**************************
+ * Transform benchmark    *
+ **************************/
+
+/* --transform-bench N places the six vertices of N block sized quads four
+   ways and prints the best time per object of TRANSFORM_BENCH_PASSES:
+   a glm::mat4 built for each object, as draw() used to, a cached mat4,
+   every object through the full 2x3 path, and each object through the
+   path for its kind. As in a game, most objects are blocks that only
+   translate. Objects are grouped by kind, like the render queue's runs. */
+#define TRANSFORM_BENCH_PASSES 20
+
+static const GLfloat BENCH_QUAD[12] = {
+    -BLOCK_HALF_WIDTH, -BLOCK_HALF_HEIGHT,  BLOCK_HALF_WIDTH, -BLOCK_HALF_HEIGHT,  BLOCK_HALF_WIDTH, BLOCK_HALF_HEIGHT,
+    BLOCK_HALF_WIDTH, BLOCK_HALF_HEIGHT,  -BLOCK_HALF_WIDTH, BLOCK_HALF_HEIGHT,  -BLOCK_HALF_WIDTH, -BLOCK_HALF_HEIGHT,
+};
+
+template <TransformKind kind>
+void transformQuads (const Affine2D *transforms, long count, float *out)
+{
+    for (long i=0; i<count; i++)
+        for (int k=0; k<6; k++, out+=2)
+            transformPoint<kind>(transforms[i], BENCH_QUAD[2*k], BENCH_QUAD[2*k+1], out[0], out[1]);
+}
+
+glm::mat4 benchModel (float x, float y, float angle, float scale)
+{
+    return glm::translate(glm::vec3(x, y, 0)) * glm::rotate(angle, glm::vec3(0,0,1)) * glm::scale(glm::vec3(scale, scale, 1));
+}
+
+void transformQuadsMat4 (const glm::mat4 &model, float *out)
+{
+    for (int k=0; k<6; k++, out+=2) {
+        glm::vec4 p = model * glm::vec4(BENCH_QUAD[2*k], BENCH_QUAD[2*k+1], 0, 1);
+        out[0] = p.x;
+        out[1] = p.y;
+    }
+}
+
+int runTransformBench (long count)
+{
+    long rotated = count/10, affine = count/20, translated = count - rotated - affine;
+    vector <float> x(count), y(count), angle(count, 0.0f), scale(count, 1.0f);
+    vector <Affine2D> transforms(count);
+    vector <glm::mat4> models(count);
+    for (long i=0; i<count; i++) {
+        x[i] = (i % 97)*0.08f - 4;
+        y[i] = (i % 89)*0.09f - 4;
+        if (i >= translated)
+            angle[i] = (i % 360)*M_PI/180.0f;
+        if (i >= translated + rotated)
+            scale[i] = 1 + (i % 7)*0.1f;
+        transforms[i] = rigidTransform(cos(angle[i]), sin(angle[i]), x[i], y[i]);
+        transforms[i].a *= scale[i];
+        transforms[i].b *= scale[i];
+        transforms[i].c *= scale[i];
+        transforms[i].d *= scale[i];
+        models[i] = benchModel(x[i], y[i], angle[i], scale[i]);
+    }
+
+    const char *names[] = { "glm::mat4 built per object", "glm::mat4 cached", "2x3, full affine", "2x3 by kind" };
+    const int ways = sizeof(names)/sizeof(names[0]);
+    vector <float> out[ways];
+    double best[ways];
+    for (int w=0; w<ways; w++) {
+        out[w].resize(12*count);
+        best[w] = 1e30;
+    }
+    for (int pass=0; pass<TRANSFORM_BENCH_PASSES; pass++)
+        for (int w=0; w<ways; w++) {
+            float *o = out[w].data();
+            double start = nowMs();
+            if (w == 0)
+                for (long i=0; i<count; i++)
+                    transformQuadsMat4(benchModel(x[i], y[i], angle[i], scale[i]), o + 12*i);
+            else if (w == 1)
+                for (long i=0; i<count; i++)
+                    transformQuadsMat4(models[i], o + 12*i);
+            else if (w == 2)
+                transformQuads<TRANSFORM_AFFINE>(transforms.data(), count, o);
+            else {
+                transformQuads<TRANSFORM_TRANSLATE>(transforms.data(), translated, o);
+                transformQuads<TRANSFORM_ROTATE>(transforms.data() + translated, rotated, o + 12*translated);
+                transformQuads<TRANSFORM_AFFINE>(transforms.data() + translated + rotated, affine, o + 12*(translated + rotated));
+            }
+            best[w] = min(best[w], nowMs() - start);
+        }
+
+    // Every way must put the vertices in the same place
+    float difference = 0;
+    for (int w=1; w<ways; w++)
+        for (long i=0; i<12*count; i++)
+            difference = max(difference, fabsf(out[w][i] - out[0][i]));
+
+    printf("%ld objects: %ld translated, %ld rotated, %ld affine, best of %d passes\n",
+           count, translated, rotated, affine, TRANSFORM_BENCH_PASSES);
+    for (int w=0; w<ways; w++)
+        printf("  %-28s %7.2f ns per object\n", names[w], best[w]*1e6/count);
+    printf("  largest difference from the first %g\n", difference);
+    return 0;
+}
+
+/**************************
+ * Background music       *
+ **************************/
+
+/* q.mp3 is opened and played in a loop on its own thread, so device and
+   decoder setup overlap with GL context creation and never hold up a frame */
+atomic<bool> audio_stop(false);
+atomic<long> music_position(0);     // in samples, for save states
+atomic<long> music_seek(-1);        // set to have the music jump there
+
+void playMusic ()
+{
+    mpg123_handle *mh;
+    unsigned char *buffer;
+    size_t buffer_size;
+    size_t done;
+    int err;
+
+    int driver;
+    ao_device *dev = NULL;
+
+    ao_sample_format format;
+    int channels, encoding;
+    long rate;
+    bool opened;
+
+    {
+        StartupTimer timer("ao_initialize", "audio");
+        ao_initialize();
+        driver = ao_default_driver_id();
+    }
+    {
+        StartupTimer timer("mpg123 open q.mp3", "audio");
+        mpg123_init();
+        mh = mpg123_new(NULL, &err);
+        buffer_size = 3200;
+        buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
+
+        /* open the file and get the decoding format */
+        opened = mh && mpg123_open(mh, "q.mp3") == MPG123_OK &&
+                 mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK;
+    }
+    if (!opened)
+        fprintf(stderr, "Cannot decode q.mp3, playing without music\n");
+    else {
+        StartupTimer timer("ao_open_live", "audio");
+        /* set the output format and open the output device */
+        memset(&format, 0, sizeof(format));
+        format.bits = mpg123_encsize(encoding) * BITS;
+        format.rate = rate;
+        format.channels = channels;
+        format.byte_format = AO_FMT_NATIVE;
+        format.matrix = 0;
+        dev = ao_open_live(driver, &format, NULL);
+        if (!dev)
+            fprintf(stderr, "No audio device, playing without music\n");
+    }
+
+    // Loop the track: rewind once each time it stops, and give up if it
+    // cannot be read again from the start
+    bool rewound = false;
+    while (dev && !audio_stop)
+    {
+        long seek = music_seek.exchange(-1);
+        if (seek >= 0)
+            mpg123_seek(mh, seek, SEEK_SET);
+        music_position = mpg123_tell(mh);
+        int result = mpg123_read(mh, buffer, buffer_size, &done);
+        if (done > 0) {
+            ao_play(dev, (char*) buffer, done);
+            rewound = false;
+        }
+        if (result == MPG123_OK)
+            continue;
+        if (rewound || mpg123_seek(mh, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "Cannot read q.mp3, stopping the music\n");
+            break;
+        }
+        rewound = true;
+    }
+
+    free(buffer);
+    if (dev)
+        ao_close(dev);
+    if (mh) {
+        mpg123_close(mh);
+        mpg123_delete(mh);
+    }
+    mpg123_exit();
+    ao_shutdown();
+}
+
+/**************************
+ * Save states            *
+ **************************/
+
+/* With --save FILE the world is written every few seconds to a fixed
+   layout file that stays mmap'ed, and a restarted game resumes from it.
+   The file holds two slots written in turn, each with a checksum, so
+   losing power halfway through a save leaves the previous one intact. */
+
+#define SAVE_MAGIC 0x56534242   // "BBSV"
+#define SAVE_VERSION 1
+#define SAVE_MAX_BLOCKS 256
+#define SAVE_MAX_EVENTS 512
+#define SAVE_MAX_MIRRORS 64
+#define AUTOSAVE_TICKS (SIM_HZ*5)
+
+struct SaveSlot {
+    uint64_t checksum;          // of everything after it in the slot
+    uint64_t sequence;          // the newest valid slot is restored, 0 if never written
+    uint64_t level_hash;        // of the level binary
+    float screen_x, screen_y, zoom;
+    int64_t music_sample;
+    SimValues values;
+    uint32_t num_blocks, num_events, num_band_blocks, num_mirrors;
+    Scalar block_x[SAVE_MAX_BLOCKS], block_base_y[SAVE_MAX_BLOCKS];
+    int block_color[SAVE_MAX_BLOCKS];
+    long block_serial[SAVE_MAX_BLOCKS], band_blocks[SAVE_MAX_BLOCKS];
+    BlockEvent block_events[SAVE_MAX_EVENTS];
+    Scalar mirror_x[SAVE_MAX_MIRRORS], mirror_y[SAVE_MAX_MIRRORS], mirror_phase[SAVE_MAX_MIRRORS];
+};
+
+struct SaveFile {
+    uint32_t magic, version;
+    uint32_t slot_size, flags;  // flags as in the replay header
+    SaveSlot slots[2];
+};
+
+/* msync(MS_SYNC) waits for the disk, so it runs on its own thread */
+struct SaveState {
+    SaveFile *file;
+    uint64_t sequence;          // of the newest slot
+    long last_save_tick;
+    thread syncer;
+    mutex lock;
+    condition_variable wake;
+    bool stop;
+    atomic<bool> syncing;
+    SimState restore;           // sized for the level when the file is opened, so F9 does not allocate
+} save_state;
+
+uint64_t slotChecksum (const SaveSlot &slot)
+{
+    return hashWords(&slot.sequence, sizeof(slot) - offsetof(SaveSlot, sequence));
+}
+
+void saveSyncLoop ()
+{
+    SaveState &s = save_state;
+    unique_lock<mutex> lock(s.lock);
+    while (true) {
+        s.wake.wait(lock, [&s] { return s.syncing || s.stop; });
+        if (s.syncing) {
+            lock.unlock();
+            msync(s.file, sizeof(SaveFile), MS_SYNC);
+            lock.lock();
+            s.syncing = false;
+        }
+        if (s.stop)
+            return;
+    }
+}
+
+/* Write the world into the older slot and have it synced in the background.
+   Does nothing while the last save is still being synced. */
+bool saveWorld ()
+{
+    SaveState &s = save_state;
+    if (!s.file || s.syncing)
+        return false;
+    if (block_x.size() > SAVE_MAX_BLOCKS || block_events.size() > SAVE_MAX_EVENTS ||
+        band_blocks.size() > SAVE_MAX_BLOCKS || mirror_x.size() > SAVE_MAX_MIRRORS) {
+        fprintf(stderr, "World too large to save\n");
+        return false;
+    }
+    SaveSlot &slot = s.file->slots[s.file->slots[0].sequence > s.file->slots[1].sequence];
+    slot.sequence = ++s.sequence;
+    slot.level_hash = hashWords(level.map, level.map_size);
+    slot.screen_x = screen_x;
+    slot.screen_y = screen_y;
+    slot.zoom = zoom;
+    slot.music_sample = music_position;
+    captureValues(slot.values);
+    slot.num_blocks = block_x.size();
+    slot.num_events = block_events.size();
+    slot.num_band_blocks = band_blocks.size();
+    slot.num_mirrors = mirror_x.size();
+    copy(block_x.begin(), block_x.end(), slot.block_x);
+    copy(block_base_y.begin(), block_base_y.end(), slot.block_base_y);
+    copy(block_color.begin(), block_color.end(), slot.block_color);
+    copy(block_serial.begin(), block_serial.end(), slot.block_serial);
+    copy(band_blocks.begin(), band_blocks.end(), slot.band_blocks);
+    copy(block_events.begin(), block_events.end(), slot.block_events);
+    copy(mirror_x.begin(), mirror_x.end(), slot.mirror_x);
+    copy(mirror_y.begin(), mirror_y.end(), slot.mirror_y);
+    copy(mirror_phase.begin(), mirror_phase.end(), slot.mirror_phase);
+    slot.checksum = slotChecksum(slot);
+    s.last_save_tick = sim_tick;
+    {
+        lock_guard<mutex> lock(s.lock);
+        s.syncing = true;
+    }
+    s.wake.notify_one();
+    return true;
+}
+
+/* Restore the newest slot that is intact and was saved on this level */
+bool restoreWorld ()
+{
+    SaveState &s = save_state;
+    if (!s.file)
+        return false;
+    uint64_t level_hash = hashWords(level.map, level.map_size);
+    const SaveSlot *newest = NULL;
+    for (int i=0; i<2; i++) {
+        const SaveSlot &slot = s.file->slots[i];
+        if (slot.sequence == 0 || slot.checksum != slotChecksum(slot) || slot.level_hash != level_hash ||
+            slot.num_blocks > SAVE_MAX_BLOCKS || slot.num_events > SAVE_MAX_EVENTS ||
+            slot.num_band_blocks > SAVE_MAX_BLOCKS || slot.num_mirrors != mirror_x.size())
+            continue;
+        if (!newest || slot.sequence > newest->sequence)
+            newest = &slot;
+    }
+    if (!newest)
+        return false;
+
+    const SaveSlot &slot = *newest;
+    SimState &state = s.restore;
+    state.values = slot.values;
+    state.block_x.assign(slot.block_x, slot.block_x + slot.num_blocks);
+    state.block_base_y.assign(slot.block_base_y, slot.block_base_y + slot.num_blocks);
+    state.block_color.assign(slot.block_color, slot.block_color + slot.num_blocks);
+    state.block_serial.assign(slot.block_serial, slot.block_serial + slot.num_blocks);
+    state.band_blocks.assign(slot.band_blocks, slot.band_blocks + slot.num_band_blocks);
+    state.block_events.assign(slot.block_events, slot.block_events + slot.num_events);
+    state.mirror_x.assign(slot.mirror_x, slot.mirror_x + slot.num_mirrors);
+    state.mirror_y.assign(slot.mirror_y, slot.mirror_y + slot.num_mirrors);
+    state.mirror_phase.assign(slot.mirror_phase, slot.mirror_phase + slot.num_mirrors);
+    restoreState(state);
+    screen_x = slot.screen_x;
+    screen_y = slot.screen_y;
+    zoom = slot.zoom;
+    music_seek = slot.music_sample;
+    s.sequence = max(s.sequence, slot.sequence);
+    s.last_save_tick = sim_tick;
+    return true;
+}
+
+/* Map the save file, creating it if needed, and resume from it when it holds a save of this level */
+bool openSaveFile (const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open save file %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    bool fresh = st.st_size != sizeof(SaveFile);
+    if (fresh && ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(SaveFile)) != 0) {
+        fprintf(stderr, "Cannot write save file %s\n", path);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, sizeof(SaveFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map save file %s\n", path);
+        return false;
+    }
+
+    SaveState &s = save_state;
+    s.file = (SaveFile*) map;
+    if (fresh || s.file->magic != SAVE_MAGIC || s.file->version != SAVE_VERSION ||
+        s.file->slot_size != sizeof(SaveSlot) || s.file->flags != replayFlags()) {
+        // Not ours or from another build: start over
+        memset((void*) s.file, 0, sizeof(SaveFile));
+        s.file->magic = SAVE_MAGIC;
+        s.file->version = SAVE_VERSION;
+        s.file->slot_size = sizeof(SaveSlot);
+        s.file->flags = replayFlags();
+    }
+    // Carry on from the newest slot even if it is from another level, so
+    // saves keep going to the older slot and a torn write leaves the other one
+    s.sequence = max(s.file->slots[0].sequence, s.file->slots[1].sequence);
+    size_t max_blocks = min((size_t) SAVE_MAX_BLOCKS, maxLiveBlocks(*level.header));
+    s.restore.block_x.reserve(max_blocks);
+    s.restore.block_base_y.reserve(max_blocks);
+    s.restore.block_color.reserve(max_blocks);
+    s.restore.block_serial.reserve(max_blocks);
+    s.restore.band_blocks.reserve(max_blocks);
+    s.restore.block_events.reserve(max_blocks);
+    s.restore.mirror_x.reserve(mirror_x.size());
+    s.restore.mirror_y.reserve(mirror_y.size());
+    s.restore.mirror_phase.reserve(mirror_phase.size());
+    s.stop = false;
+    s.syncing = false;
+    if (restoreWorld())
+        printf("Resumed from %s at tick %ld\n", path, sim_tick);
+    s.syncer = thread(saveSyncLoop);
+    return true;
+}
+
+/* Main thread, between ticks: autosave, and F5/F9 */
+void updateSaveState ()
+{
+    SaveState &s = save_state;
+    if (!s.file)
+        return;
+    if (restore_requested)
+        restoreWorld();
+    else if (save_requested || sim_tick - s.last_save_tick >= AUTOSAVE_TICKS)
+        saveWorld();
+    save_requested = restore_requested = false;
+}
+
+void closeSaveFile ()
+{
+    SaveState &s = save_state;
+    if (!s.file)
+        return;
+    {
+        lock_guard<mutex> lock(s.lock);
+        s.stop = true;
+    }
+    s.wake.notify_one();
+    s.syncer.join();
+    munmap(s.file, sizeof(SaveFile));
+    s.file = NULL;
+}
+
+int main (int argc, char** argv)
+{
+    if(argc == 2 && strcmp(argv[1], "--self-test") == 0)
+        return runSelfTest();
+    if(argc == 4 && strcmp(argv[1], "--compile-level") == 0)
+        return compileLevel(argv[2], argv[3]) ? 0 : 1;
+    if(!parseOptions(argc, argv) || !(renderer = findRenderer(options.renderer)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(options.transform_bench > 0)
+        return runTransformBench(options.transform_bench);
+    sim_rng = time(NULL) | 1;      // xorshift needs a non-zero seed
+    ReplayHeader replay_header;
+    if(options.play_path && !openReplay(options.play_path, replay_header))
+        return 1;
+    {
+        StartupTimer timer("loadLevel");
+        if(!loadLevel(options.level_path))
+            return 1;
+    }
+    if(options.play_path && !startPlayback(replay_header))
+        return 1;
+    if(options.play_path && options.seek_tick > 0)
+        seekReplay(options.seek_tick);
+    if(options.verify_replay || options.sim_check_ticks > 0)
+    {
+        int status = options.verify_replay ? runReplayCheck() : runSimCheck(options.sim_check_ticks);
+        stopReplay();
+        unloadLevel();
+        return status;
+    }
+    if(options.record_path && !startRecording(options.record_path, options.record_hashes))
+        return 1;
+    if(options.save_path && !openSaveFile(options.save_path))
+        return 1;
+
+    /* initializations */
+    thread music(playMusic);
+
+    int width = 600;
+    int height = 600;
+
+    window = initGLFW(width, height);
+    reshapeWindow (window, width, height);
+
+    // Room for every block the level can have in play, in the world and in
+    // each snapshot, so spawning does not allocate mid-game
+    size_t max_blocks = maxLiveBlocks(*level.header);
+    reserveBlocks(max_blocks);
+    for (int i=0; i<3; i++) {
+        snapshots.slots[i].mirror_x.reserve(level.header->num_mirrors);
+        snapshots.slots[i].mirror_y.reserve(level.header->num_mirrors);
+        snapshots.slots[i].block_x.reserve(max_blocks);
+        snapshots.slots[i].block_base_y.reserve(max_blocks);
+        snapshots.slots[i].block_color.reserve(max_blocks);
+    }
+    captureSnapshot(snapshots.writeSlot(), sim_tick);
+    snapshots.publish();
+
+    thread render_thread(renderLoop);
+
+    /* Simulate in loop, the render thread draws what each tick publishes */
+    chrono::steady_clock::time_point next_tick = chrono::steady_clock::now();
+    const chrono::steady_clock::duration tick_length = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0/SIM_HZ));
+    while (!glfwWindowShouldClose(window))
+    {
+        updateSaveState();
+        if(gameIdle())
+        {
+            // Paused or in the background: block on input, republish so the
+            // render thread can show aim and zoom changes, music keeps playing
+            glfwWaitEventsTimeout(0.25);
+            captureSnapshot(snapshots.writeSlot(), sim_tick);
+            snapshots.publish();
+            wakeRenderer();
+            next_tick = chrono::steady_clock::now();
+            continue;
+        }
+
+        // Poll for Keyboard and mouse events
+        glfwPollEvents();
+
+        if(!replayBeforeTick())
+            break;      // the replay being played has ended
+        simulate();
+        replayAfterTick();
+        captureSnapshot(snapshots.writeSlot(), sim_tick);
+        snapshots.publish();
+#ifdef COUNT_ALLOCATIONS
+        checkAllocations("tick", sim_tick);
+#endif
+
+        if(score< level.header->lose_below)
+            break;
+
+        next_tick += tick_length;
+        this_thread::sleep_until(next_tick);
+    }
+    if(score > 100)
+        cout << "YOU WON" << endl;
+    if(score < 100)
+        cout << "YOU LOST" << endl;
+    cout << score << endl;
+    stopReplay();
+    closeSaveFile();
+    render_stop = true;
+    wakeRenderer();
+    render_thread.join();
+    audio_stop = true;
+    music.join();
+    glfwDestroyWindow(window);
     glfwTerminate();
+    unloadLevel();
 
     return 0;
     //    exit(EXIT_SUCCESS);
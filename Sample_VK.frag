@@ -0,0 +1,12 @@
+#version 450
+
+// Interpolated values from the vertex shaders
+layout (location = 0) in vec3 fragColor;
+
+// output data
+layout (location = 0) out vec4 color;
+
+void main()
+{
+    color = vec4(fragColor, 1);
+}
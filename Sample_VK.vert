@@ -0,0 +1,28 @@
+#version 450
+
+// Sample_GL.vert for the Vulkan renderer: one color per mesh, pushed with its draw
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 3) in vec4 objectInstance;   // cos, sin of the rotation, then x, y
+
+layout (set = 0, binding = 0) uniform Frame {
+    mat4 VP;                    // already flipped into Vulkan's clip space
+    vec4 palette[3];            // color of each block kind, for Block_VK.vert
+};
+
+layout (push_constant) uniform Mesh {
+    vec4 color;
+};
+
+// output data : used by fragment shader
+layout (location = 0) out vec3 fragColor;
+
+void main ()
+{
+    // Rotate about the object's origin, then move it into place
+    vec2 p = vec2(objectInstance.x * vertexPosition.x - objectInstance.y * vertexPosition.y,
+                  objectInstance.y * vertexPosition.x + objectInstance.x * vertexPosition.y);
+
+    fragColor = color.rgb;
+
+    gl_Position = VP * vec4(p + objectInstance.zw, vertexPosition.z, 1);
+}